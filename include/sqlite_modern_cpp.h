@@ -90,6 +90,102 @@ namespace sqlite {
 		}
 	};
 
+	// A statement which is prepared once and can then be executed (or queried) many times
+	class statement {
+	private:
+		sqlite3 * _db;
+		sqlite3_stmt* _stmt;
+		int _inx;
+
+	public:
+		statement() : _db(nullptr), _stmt(nullptr), _inx(1) {}
+
+		statement(sqlite3 * db, std::string const & sql) : _db(db), _stmt(nullptr), _inx(1) {
+			if (sqlite3_prepare_v2(_db, sql.data(), -1, &_stmt, nullptr) != SQLITE_OK)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+		}
+
+		statement(statement const &) = delete;
+		statement& operator=(statement const &) = delete;
+		statement(statement && other) : _db(other._db), _stmt(other._stmt), _inx(other._inx) {
+			other._stmt = nullptr;
+		}
+		statement& operator=(statement && other) {
+			if (this != &other) {
+				if (_stmt) sqlite3_finalize(_stmt);
+				_db = other._db; _stmt = other._stmt; _inx = other._inx;
+				other._stmt = nullptr;
+			}
+			return *this;
+		}
+
+		~statement() {
+			if (_stmt) sqlite3_finalize(_stmt);
+		}
+
+		statement& operator <<(int val) {
+			if (sqlite3_bind_int(_stmt, _inx, val) != SQLITE_OK)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			++_inx;
+			return *this;
+		}
+		statement& operator <<(sqlite_int64 val) {
+			if (sqlite3_bind_int64(_stmt, _inx, val) != SQLITE_OK)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			++_inx;
+			return *this;
+		}
+		statement& operator <<(std::string const& txt) {
+			if (sqlite3_bind_text(_stmt, _inx, txt.data(), txt.size(), SQLITE_TRANSIENT) != SQLITE_OK)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			++_inx;
+			return *this;
+		}
+		statement& operator &&(std::string const& txt) {
+			if (sqlite3_bind_blob(_stmt, _inx, txt.data(), txt.size(), SQLITE_TRANSIENT) != SQLITE_OK)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			++_inx;
+			return *this;
+		}
+
+		// Run the statement, then reset it ready for new values to be bound
+		void execute() {
+			int rc = sqlite3_step(_stmt);
+			reset();
+			if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+		}
+
+		// Step to the next result row, or reset and return false when there are no more
+		bool fetch() {
+			int rc = sqlite3_step(_stmt);
+			if (rc == SQLITE_ROW) return true;
+			reset();
+			if (rc != SQLITE_DONE)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			return false;
+		}
+
+		// Column values of the current row
+		int get_int(int col) {
+			return sqlite3_column_int(_stmt, col);
+		}
+		std::string get_text(int col) {
+			const char *txt = reinterpret_cast<const char *>(sqlite3_column_text(_stmt, col));
+			return txt ? std::string(txt, sqlite3_column_bytes(_stmt, col)) : std::string();
+		}
+		std::string get_blob(int col) {
+			const char *blob = static_cast<const char *>(sqlite3_column_blob(_stmt, col));
+			return blob ? std::string(blob, sqlite3_column_bytes(_stmt, col)) : std::string();
+		}
+
+		void reset() {
+			sqlite3_reset(_stmt);
+			sqlite3_clear_bindings(_stmt);
+			_inx = 1;
+		}
+	};
+
 	class database {
 	private:
 		sqlite3 * _db = nullptr;
@@ -102,7 +198,7 @@ namespace sqlite {
 		void init(std::string const & db_name) {
 			std::string name(db_name.begin(), db_name.end());
 			_db = nullptr;
-			_ownes_db = false;
+			_ownes_db = true;
 			_connected = sqlite3_open(db_name.data(), &_db) == SQLITE_OK;
 		}
 		
@@ -127,6 +223,10 @@ namespace sqlite {
 			return database_binder(_db, sql);
 		}
 
+		statement prepare(std::string const& sql) const {
+			return statement(_db, sql);
+		}
+
 		operator bool() const {
 			return _connected;
 		}
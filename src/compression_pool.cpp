@@ -0,0 +1,126 @@
+/*
+	CompressionPool - compress tiles on worker threads, between generating and writing them
+
+	Tiles are queued as they're generated; each worker compresses them with its own reusable
+	Compressor, at the level and strategy set for the tile's zoom, then hands them on to the
+	sink, which writes them. The sink is only ever called by one thread at a time, so it
+	needn't be thread-safe, but tiles may reach it in a different order from that in which
+	they were queued.
+
+	Tiles to be removed (in update mode, when nothing is left in them) and uncompressed output
+	go straight to the sink. An empty tile that isn't being removed is compressed and written
+	like any other.
+*/
+
+class CompressionPool { public:
+
+	static const uint QUEUE_SIZE = 1000;		// tiles waiting to be compressed before add blocks
+
+	struct Tile {
+		uint zoom, x, y;
+		TileKey index;
+		string data;
+		size_t uncompressedSize;
+		bool remove;						// delete the tile from the output, rather than write it
+	};
+	typedef function<void(Tile &)> Sink;
+
+	// levels and strategies are per zoom level, with the last one applying to any higher zooms
+	// (if empty, zlib's defaults are used)
+	CompressionPool(uint threads, bool compress, bool gzip, const vector<int> &levels, const vector<int> &strategies, Sink sink) :
+		compress(compress), gzip(gzip), levels(levels), strategies(strategies), sink(sink) {
+		if (!compress) { return; }
+		for (uint i=0; i<max(threads,1u); i++) {
+			workers.emplace_back(&CompressionPool::compressQueue, this);
+		}
+	}
+
+	~CompressionPool() {
+		try { finish(); } catch (exception &e) { cerr << "Error writing tiles: " << e.what() << endl; }
+	}
+
+	// Queue a tile to be compressed and written (or removed)
+	void add(uint zoom, uint x, uint y, TileKey index, string &&data, bool remove = false) {
+		Tile tile { zoom, x, y, index, move(data), 0, remove };
+		tile.uncompressedSize = tile.data.size();
+		if (workers.empty() || tile.remove) {
+			if (failed) { rethrowError(); }
+			lock_guard<mutex> lock(sinkMutex);
+			sink(tile);
+			return;
+		}
+		unique_lock<mutex> lock(queueMutex);
+		queueNotFull.wait(lock, [&]{ return queue.size() < QUEUE_SIZE || failed; });
+		if (failed) { lock.unlock(); rethrowError(); }
+		queue.push_back(move(tile));
+		queueNotEmpty.notify_one();
+	}
+
+	// Wait for all queued tiles to be compressed and written
+	void finish() {
+		if (finished) { return; }
+		finished = true;
+		{
+			lock_guard<mutex> lock(queueMutex);
+			closing = true;
+			queueNotEmpty.notify_all();
+		}
+		for (auto &worker : workers) {
+			if (worker.joinable()) { worker.join(); }
+		}
+		if (failed) { rethrowError(); }
+	}
+
+	int levelFor(uint zoom) const { return zoomSetting(levels, zoom, Z_DEFAULT_COMPRESSION); }
+	int strategyFor(uint zoom) const { return zoomSetting(strategies, zoom, Z_DEFAULT_STRATEGY); }
+
+private:
+	bool compress, gzip;
+	vector<int> levels, strategies;
+	Sink sink;
+
+	vector<thread> workers;
+	mutex queueMutex, sinkMutex;
+	condition_variable queueNotEmpty, queueNotFull;
+	deque<Tile> queue;
+	bool closing = false;
+	bool finished = false;
+	atomic<bool> failed { false };
+	mutex errorMutex;
+	exception_ptr error;
+
+	void rethrowError() {
+		lock_guard<mutex> lock(errorMutex);
+		rethrow_exception(error);
+	}
+
+	// Worker thread: take tiles off the queue, compress them and pass them to the sink
+	void compressQueue() {
+		Compressor compressor(gzip);
+		try {
+			while (true) {
+				Tile tile;
+				{
+					unique_lock<mutex> lock(queueMutex);
+					queueNotEmpty.wait(lock, [&]{ return !queue.empty() || closing || failed; });
+					if (queue.empty() || failed) { break; }
+					tile = move(queue.front());
+					queue.pop_front();
+					queueNotFull.notify_one();
+				}
+				tile.data = compressor.compress(tile.data, levelFor(tile.zoom), strategyFor(tile.zoom));
+				lock_guard<mutex> lock(sinkMutex);
+				sink(tile);
+			}
+		} catch (...) {
+			{
+				lock_guard<mutex> lock(errorMutex);
+				if (!error) { error = current_exception(); }
+			}
+			failed = true;
+			lock_guard<mutex> lock(queueMutex);
+			queueNotFull.notify_all();
+			queueNotEmpty.notify_all();
+		}
+	}
+};
@@ -5,6 +5,28 @@ struct LatpLon {
 	int32_t lon;
 };
 
+// Bounding box, in the same fixed-point units as LatpLon
+struct LatpLonBox {
+	int32_t minLatp = INT32_MAX;
+	int32_t minLon  = INT32_MAX;
+	int32_t maxLatp = INT32_MIN;
+	int32_t maxLon  = INT32_MIN;
+
+	void expand(LatpLon ll) {
+		minLatp = min(minLatp, ll.latp); maxLatp = max(maxLatp, ll.latp);
+		minLon  = min(minLon , ll.lon ); maxLon  = max(maxLon , ll.lon );
+	}
+	void expand(const Box &box) {
+		expand(LatpLon { int32_t(box.min_corner().get<1>()*10000000.0), int32_t(box.min_corner().get<0>()*10000000.0) });
+		expand(LatpLon { int32_t(box.max_corner().get<1>()*10000000.0), int32_t(box.max_corner().get<0>()*10000000.0) });
+	}
+	bool empty() const { return minLon > maxLon; }
+
+	// Width and height in degrees (of longitude and projected latitude respectively)
+	double width()  const { return empty() ? 0 : (double(maxLon )-minLon )/10000000.0; }
+	double height() const { return empty() ? 0 : (double(maxLatp)-minLatp)/10000000.0; }
+};
+
 double deg2rad(double deg) { return (M_PI/180.0) * deg; }
 double rad2deg(double rad) { return (180.0/M_PI) * rad; }
 
@@ -25,12 +47,71 @@ double tilex2lon(uint x, uint z) { return scalbn(x, -(int)z) * 360.0 - 180.0; }
 double tiley2latp(uint y, uint z) { return 180.0 - scalbn(y, -(int)z) * 360.0; }
 double tiley2lat(uint y, uint z) { return latp2lat(tiley2latp(y, z)); }
 
+// Tile keys: x and y interleaved bitwise (a Morton or Z-order curve), so tiles near each other
+// usually have nearby keys, and the key of a tile's parent n zoom levels up is just key >> 2n
+typedef uint64_t TileKey;
+
+inline uint64_t spreadBits(uint32_t v) {
+	uint64_t x = v;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x <<  8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x <<  2)) & 0x3333333333333333ULL;
+	x = (x | (x <<  1)) & 0x5555555555555555ULL;
+	return x;
+}
+inline uint32_t compactBits(uint64_t x) {
+	x &= 0x5555555555555555ULL;
+	x = (x | (x >>  1)) & 0x3333333333333333ULL;
+	x = (x | (x >>  2)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x >>  4)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x >>  8)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+	return x;
+}
+inline TileKey tileKey(uint x, uint y) { return (spreadBits(x) << 1) | spreadBits(y); }
+inline uint tileKeyX(TileKey key) { return compactBits(key >> 1); }
+inline uint tileKeyY(TileKey key) { return compactBits(key); }
+inline TileKey parentTileKey(TileKey key, uint zoom, uint parentZoom) { return key >> (2*(zoom-parentZoom)); }
+
+// Position of a tile along a Hilbert curve covering its zoom level
+inline void hilbertRotate(uint64_t n, uint64_t &x, uint64_t &y, uint64_t rx, uint64_t ry) {
+	if (ry==0) {
+		if (rx==1) { x = n-1-x; y = n-1-y; }
+		swap(x, y);
+	}
+}
+uint64_t hilbertIndex(uint zoom, uint x, uint y) {
+	uint64_t tx = x, ty = y, d = 0;
+	for (uint64_t s = (1ULL << zoom)/2; s>0; s/=2) {
+		uint64_t rx = (tx & s) > 0;
+		uint64_t ry = (ty & s) > 0;
+		d += s * s * ((3*rx) ^ ry);
+		hilbertRotate(s, tx, ty, rx, ry);
+	}
+	return d;
+}
+
+// Order in which tiles are written out
+enum TileOrder { ORDER_MORTON, ORDER_HILBERT, ORDER_COLUMNS };
+
+uint64_t tileOrderKey(TileOrder order, TileKey key, uint zoom) {
+	switch (order) {
+		case ORDER_HILBERT: return hilbertIndex(zoom, tileKeyX(key), tileKeyY(key));
+		case ORDER_COLUMNS: return (uint64_t(tileKeyX(key)) << 32) | tileKeyY(key);
+		default:            return key;
+	}
+}
+
 // Get a tile index
-uint32_t latpLon2index(LatpLon ll, uint baseZoom) {
-	return lon2tilex(ll.lon /10000000.0, baseZoom) * 65536 +
-	       latp2tiley(ll.latp/10000000.0, baseZoom);
+TileKey latpLon2index(LatpLon ll, uint baseZoom) {
+	return tileKey(lon2tilex(ll.lon /10000000.0, baseZoom),
+	               latp2tiley(ll.latp/10000000.0, baseZoom));
 }
 
+// Size of a pixel (in degrees) when a tile at this zoom is rendered at 256x256
+double pixelSize(uint z) { return scalbn(360.0/256.0, -(int)z); }
+
 // Earth's (mean) radius
 // http://nssdc.gsfc.nasa.gov/planetary/factsheet/earthfact.html
 // http://mathworks.com/help/map/ref/earthradius.html
@@ -45,7 +126,7 @@ double meter2degp(double meter, double latp) {
 }
 
 // Add intermediate points so we don't skip tiles on long segments
-void insertIntermediateTiles(unordered_set <uint32_t> *tlPtr, int numPoints, LatpLon startLL, LatpLon endLL, uint baseZoom) {
+void insertIntermediateTiles(unordered_set <TileKey> *tlPtr, int numPoints, LatpLon startLL, LatpLon endLL, uint baseZoom) {
 	numPoints *= 3;	// perhaps overkill, but why not
 	int32_t dLon  = endLL.lon -startLL.lon ;
 	int32_t dLatp = endLL.latp-startLL.latp;
@@ -63,13 +144,14 @@ void insertIntermediateTiles(unordered_set <uint32_t> *tlPtr, int numPoints, Lat
 class TileBbox { public:
 	double minLon, maxLon, minLat, maxLat, minLatp, maxLatp;
 	double xmargin, ymargin, xscale, yscale;
-	uint index, zoom, tiley, tilex;
+	TileKey index;
+	uint zoom, tiley, tilex;
 	Box clippingBox;
 
-	TileBbox(uint i, uint z) {
+	TileBbox(TileKey i, uint z) {
 		index = i; zoom = z;
-		tiley = index & 65535;
-		tilex = index >> 16;
+		tiley = tileKeyY(index);
+		tilex = tileKeyX(index);
 		minLon = tilex2lon(tilex  ,zoom);
 		minLat = tiley2lat(tiley+1,zoom);
 		maxLon = tilex2lon(tilex+1,zoom);
@@ -90,3 +172,54 @@ class TileBbox { public:
 		return pair<int,int>(x,y);
 	}
 };
+
+// ------------------------------------------------------
+// The part of tile space written by this process, when a render is split across several:
+// an equal share of the Morton curve at each zoom level (--shard i/n), and/or a list of bounding boxes
+
+class TileShard { public:
+	uint index = 0, count = 1;
+	vector<Box> boxes;							// in lon/latp
+	uint baseZoom = 14, startZoom = 0, endZoom = 14;
+
+	bool active() const { return count>1 || !boxes.empty(); }
+
+	// Parse "i/n" (i counting from 0)
+	bool parse(const string &spec) {
+		return sscanf(spec.c_str(), "%u/%u", &index, &count)==2 && count>0 && index<count;
+	}
+
+	// Parse "minlon,minlat,maxlon,maxlat"
+	bool addBox(const string &spec) {
+		double minLon, minLat, maxLon, maxLat;
+		if (sscanf(spec.c_str(), "%lf,%lf,%lf,%lf", &minLon, &minLat, &maxLon, &maxLat)!=4) { return false; }
+		boxes.emplace_back(geom::make<Point>(minLon, lat2latp(minLat)), geom::make<Point>(maxLon, lat2latp(maxLat)));
+		return true;
+	}
+
+	// Is this tile written by this shard?
+	bool includesTile(TileKey key, uint zoom) const {
+		if (count>1) {
+			uint64_t total = 1ULL << (2*zoom);
+			uint64_t perShard = total / count + (total % count ? 1 : 0);
+			if (min<uint64_t>(key / perShard, count-1) != index) { return false; }
+		}
+		if (boxes.empty()) { return true; }
+		uint x = tileKeyX(key), y = tileKeyY(key);
+		Box tile(geom::make<Point>(tilex2lon(x, zoom), tiley2latp(y+1, zoom)),
+		         geom::make<Point>(tilex2lon(x+1, zoom), tiley2latp(y, zoom)));
+		for (auto &box : boxes) {
+			if (!geom::disjoint(tile, box)) { return true; }
+		}
+		return false;
+	}
+
+	// Does anything at this base zoom tile end up in a tile written by this shard?
+	// (i.e. is it, or any of its ancestors being written, in the shard)
+	bool includesBaseTile(TileKey key) const {
+		for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
+			if (includesTile(parentTileKey(key, baseZoom, zoom), zoom)) { return true; }
+		}
+		return false;
+	}
+};
@@ -4,6 +4,9 @@
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <map>
+#include <vector>
+#include <memory>
 #include <zlib.h>
 
 #define MOD_GZIP_ZLIB_WINDOWSIZE 15
@@ -24,6 +27,101 @@ inline bool ends_with(std::string const & value, std::string const & ending) {
 	return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+// Hash arbitrary binary data (MurmurHash64A), used to find identical tiles
+inline uint64_t murmur_hash64(const std::string &str, uint64_t seed) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const size_t len = str.size();
+	uint64_t h = seed ^ (len * m);
+
+	const char *data = str.data();
+	const char *end = data + (len & ~size_t(7));
+	for (; data != end; data += 8) {
+		uint64_t k;
+		memcpy(&k, data, 8);
+		k *= m; k ^= k >> r; k *= m;
+		h ^= k; h *= m;
+	}
+	uint64_t tail = 0;
+	switch (len & 7) {
+		case 7: tail ^= uint64_t((unsigned char)data[6]) << 48;
+		case 6: tail ^= uint64_t((unsigned char)data[5]) << 40;
+		case 5: tail ^= uint64_t((unsigned char)data[4]) << 32;
+		case 4: tail ^= uint64_t((unsigned char)data[3]) << 24;
+		case 3: tail ^= uint64_t((unsigned char)data[2]) << 16;
+		case 2: tail ^= uint64_t((unsigned char)data[1]) << 8;
+		case 1: tail ^= uint64_t((unsigned char)data[0]);
+		        h ^= tail; h *= m;
+	}
+	h ^= h >> r; h *= m; h ^= h >> r;
+	return h;
+}
+
+// 128-bit content hash as a hex string (two independently-seeded 64-bit hashes)
+inline std::string content_hash(const std::string &str) {
+	std::ostringstream oss;
+	oss << std::hex << std::setfill('0')
+	    << std::setw(16) << murmur_hash64(str, 0x5bd1e995ULL)
+	    << std::setw(16) << murmur_hash64(str, 0x9e3779b97f4a7c15ULL);
+	return oss.str();
+}
+
+// Append an unsigned integer as a (protobuf-style) varint
+inline void append_varint(std::string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+// Read a varint, advancing the pointer past it
+inline uint64_t read_varint(const char *&p, const char *end) {
+	uint64_t value = 0;
+	for (int shift=0; shift<64; shift+=7) {
+		if (p==end) { throw std::runtime_error("Truncated varint"); }
+		uint8_t byte = static_cast<uint8_t>(*p++);
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) { return value; }
+	}
+	throw std::runtime_error("Varint too long");
+}
+
+// Binary file I/O for plain values and length-prefixed strings (native byte order)
+template <typename T>
+inline void write_raw(std::ostream &out, const T &value) {
+	out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+template <typename T>
+inline T read_raw(std::istream &in) {
+	T value;
+	in.read(reinterpret_cast<char *>(&value), sizeof(T));
+	if (!in) { throw std::runtime_error("Unexpected end of file"); }
+	return value;
+}
+inline void write_string(std::ostream &out, const std::string &str) {
+	write_raw<uint32_t>(out, str.size());
+	out.write(str.data(), str.size());
+}
+inline std::string read_string(std::istream &in) {
+	std::string str(read_raw<uint32_t>(in), 0);
+	in.read(&str[0], str.size());
+	if (!in) { throw std::runtime_error("Unexpected end of file"); }
+	return str;
+}
+template <typename T>
+inline void write_vector(std::ostream &out, const std::vector<T> &v) {
+	write_raw<uint32_t>(out, v.size());
+	out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+template <typename T>
+inline std::vector<T> read_vector(std::istream &in) {
+	std::vector<T> v(read_raw<uint32_t>(in));
+	in.read(reinterpret_cast<char *>(v.data()), v.size() * sizeof(T));
+	if (!in) { throw std::runtime_error("Unexpected end of file"); }
+	return v;
+}
+
 // zlib routines from http://panthema.net/2007/0328-ZLibString.html
 
 // Compress a STL string using zlib with given compression level, and return the binary data
@@ -74,12 +172,67 @@ std::string compress_string(const std::string& str,
     return outstring;
 }
 
+// Look up a per-zoom compression setting, where the last one applies to any higher zooms
+// (fallback if there are none)
+inline int zoomSetting(const std::vector<int> &settings, unsigned zoom, int fallback) {
+	return settings.empty() ? fallback : settings[std::min<size_t>(zoom, settings.size()-1)];
+}
+
+// Compresses many strings in turn, keeping a deflate context for each level/strategy and
+// resetting it between strings, rather than setting one up and tearing it down every time
+class Compressor {
+public:
+	Compressor(bool asGzip) : asGzip(asGzip) { }
+	Compressor(const Compressor&) = delete;
+	Compressor& operator=(const Compressor&) = delete;
+	~Compressor() {
+		for (auto &it : streams) { deflateEnd(it.second.get()); }
+	}
+
+	std::string compress(const std::string &str, int level = Z_DEFAULT_COMPRESSION, int strategy = Z_DEFAULT_STRATEGY) {
+		z_stream &zs = stream(level, strategy);
+		deflateReset(&zs);
+		// (deflateBound is an upper limit, so one call to deflate does it all)
+		std::string out(deflateBound(&zs, str.size()), '\0');
+		zs.next_in = (Bytef*)str.data();
+		zs.avail_in = str.size();
+		zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+		zs.avail_out = out.size();
+		int ret = deflate(&zs, Z_FINISH);
+		if (ret != Z_STREAM_END) {
+			std::ostringstream oss;
+			oss << "Exception during zlib compression: (" << ret << ") " << (zs.msg ? zs.msg : "");
+			throw(std::runtime_error(oss.str()));
+		}
+		out.resize(zs.total_out);
+		return out;
+	}
+
+private:
+	bool asGzip;
+	std::map<std::pair<int,int>, std::unique_ptr<z_stream>> streams;
+
+	z_stream &stream(int level, int strategy) {
+		std::unique_ptr<z_stream> &zs = streams[std::make_pair(level, strategy)];
+		if (!zs) {
+			zs.reset(new z_stream());
+			memset(zs.get(), 0, sizeof(z_stream));
+			if (deflateInit2(zs.get(), level, Z_DEFLATED, MOD_GZIP_ZLIB_WINDOWSIZE + (asGzip ? 16 : 0),
+			                 MOD_GZIP_ZLIB_CFACTOR, strategy) != Z_OK) {
+				zs.reset();
+				throw(std::runtime_error("deflateInit2 failed while compressing."));
+			}
+		}
+		return *zs;
+	}
+};
+
 // Decompress an STL string using zlib and return the original data.
 std::string decompress_string(const std::string& str) {
     z_stream zs;                        // z_stream is zlib's control structure
     memset(&zs, 0, sizeof(zs));
 
-    if (inflateInit(&zs) != Z_OK)
+    if (inflateInit2(&zs, MAX_WBITS + 32) != Z_OK)	// (+32: accept zlib or gzip headers)
         throw(std::runtime_error("inflateInit failed while decompressing."));
 
     zs.next_in = (Bytef*)str.data();
@@ -0,0 +1,149 @@
+/*
+	IngestFilter - skip OSM data outside the configured bounding box while reading
+
+	When the JSON config has a bounding_box, only nodes within it (plus a margin) are stored.
+	Before the ways are read, IngestFilter scans them to find those with at least one stored node,
+	plus the other members of any multipolygon that has one. These are the only ways (and
+	relations) passed to Lua. Any nodes they need from outside the box are then read back in.
+
+	A way with no nodes in the box (plus margin) is dropped, even if it surrounds the box, so
+	the margin should be generous enough to catch the large polygons you need.
+*/
+
+class IngestFilter { public:
+
+	bool active = false;
+	Box box;							// bounding box including margin, in lon/latp
+
+	void setBox(double minLon, double minLat, double maxLon, double maxLat, double margin) {
+		active = true;
+		box = Box(geom::make<Point>(minLon - margin, lat2latp(max(minLat - margin, -85.0))),
+		          geom::make<Point>(maxLon + margin, lat2latp(min(maxLat + margin,  85.0))));
+		minLonE7  = box.min_corner().get<0>() * 10000000; maxLonE7  = box.max_corner().get<0>() * 10000000;
+		minLatpE7 = box.min_corner().get<1>() * 10000000; maxLatpE7 = box.max_corner().get<1>() * 10000000;
+	}
+
+	bool includes(LatpLon node) const {
+		return !active || (node.lon >= minLonE7 && node.lon <= maxLonE7 && node.latp >= minLatpE7 && node.latp <= maxLatpE7);
+	}
+
+	bool includesWay(WayID wayId) const {
+		return !active || keptWays.count(wayId) > 0;
+	}
+
+	bool includesRelation(const WayVec &outerWayVec, const WayVec &innerWayVec) const {
+		if (!active) { return true; }
+		for (auto wayId : outerWayVec) { if (keptWays.count(wayId)) { return true; } }
+		for (auto wayId : innerWayVec) { if (keptWays.count(wayId)) { return true; } }
+		return false;
+	}
+
+	// Find the ways to keep in a .pbf (whose ways start at wayPosition),
+	// and read in any nodes they need that weren't stored first time round
+	void scan(const string &filename, int wayPosition, NodeStore &nodes) {
+		if (!active || wayPosition == -1) { return; }
+		unordered_set<NodeID> neededNodes;
+		unordered_set<WayID> extraWays;
+
+		// Ways with a stored node, and the other members of multipolygons with one of those
+		forEachBlock(filename, wayPosition, [&](PrimitiveBlock &pb, PrimitiveGroup &pg) {
+			for (auto &pbfWay : pg.ways()) {
+				int64_t nodeId = 0;
+				bool found = false;
+				for (auto ref : pbfWay.refs()) {
+					nodeId += ref;
+					if (nodes.count(nodeId)) { found = true; break; }
+				}
+				if (found) { keepWay(pbfWay, nodes, neededNodes); }
+			}
+			int typeKey = findString(pb, "type"), mpKey = findString(pb, "multipolygon");
+			if (typeKey==-1 || mpKey==-1) { return; }
+			for (auto &pbfRelation : pg.relations()) {
+				if (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) == pbfRelation.keys().end()) { continue; }
+				if (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) == pbfRelation.vals().end()) { continue; }
+				WayVec members;
+				bool found = false;
+				int64_t lastID = 0;
+				for (int n=0; n < pbfRelation.memids_size(); n++) {
+					lastID += pbfRelation.memids(n);
+					if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
+					members.push_back(static_cast<WayID>(lastID));
+					if (keptWays.count(members.back())) { found = true; }
+				}
+				if (!found) { continue; }
+				for (auto wayId : members) {
+					if (!keptWays.count(wayId)) { extraWays.insert(wayId); }
+				}
+			}
+		});
+
+		if (!extraWays.empty()) {
+			forEachBlock(filename, wayPosition, [&](PrimitiveBlock &pb, PrimitiveGroup &pg) {
+				for (auto &pbfWay : pg.ways()) {
+					if (extraWays.count(pbfWay.id())) { keepWay(pbfWay, nodes, neededNodes); }
+				}
+			});
+		}
+
+		// Read back the nodes from outside the box that we now need
+		// (these aren't passed to Lua: tagged nodes outside the box still aren't output)
+		if (!neededNodes.empty()) {
+			forEachBlock(filename, 0, [&](PrimitiveBlock &pb, PrimitiveGroup &pg) {
+				if (!pg.has_dense()) { return; }
+				const DenseNodes &dense = pg.dense();
+				int64_t nodeId = 0;
+				int lon = 0, lat = 0;
+				for (int j=0; j<dense.id_size(); j++) {
+					nodeId += dense.id(j);
+					lon    += dense.lon(j);
+					lat    += dense.lat(j);
+					if (neededNodes.count(nodeId)) {
+						nodes.insert(nodeId, LatpLon { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon });
+					}
+				}
+			}, wayPosition);
+		}
+		cout << "Bounding box: keeping " << keptWays.size() << " ways, reading back " << neededNodes.size() << " nodes" << endl;
+	}
+
+private:
+	int32_t minLonE7 = 0, maxLonE7 = 0, minLatpE7 = 0, maxLatpE7 = 0;
+	unordered_set<WayID> keptWays;
+
+	void keepWay(const Way &pbfWay, NodeStore &nodes, unordered_set<NodeID> &neededNodes) {
+		keptWays.insert(static_cast<WayID>(pbfWay.id()));
+		int64_t nodeId = 0;
+		for (auto ref : pbfWay.refs()) {
+			nodeId += ref;
+			if (!nodes.count(nodeId)) { neededNodes.insert(nodeId); }
+		}
+	}
+
+	static int findString(PrimitiveBlock &pb, const string &str) {
+		for (int i=0; i<pb.stringtable().s_size(); i++) {
+			if (pb.stringtable().s(i) == str) { return i; }
+		}
+		return -1;
+	}
+
+	// Call a function for every primitive group in a .pbf, from a given position (up to another, if set)
+	template <typename F>
+	static void forEachBlock(const string &filename, int start, F fn, int end = -1) {
+		fstream infile(filename, ios::in | ios::binary);
+		infile.seekg(start);
+		PrimitiveBlock pb;
+		while (end == -1 || infile.tellg() < end) {
+			if (start == 0 && infile.tellg() == 0) {
+				HeaderBlock block;
+				readBlock(&block, &infile);
+				continue;
+			}
+			readBlock(&pb, &infile);
+			if (infile.eof()) { break; }
+			for (int i=0; i<pb.primitivegroup_size(); i++) {
+				PrimitiveGroup &pg = *pb.mutable_primitivegroup(i);
+				fn(pb, pg);
+			}
+		}
+	}
+};
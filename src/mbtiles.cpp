@@ -1,31 +1,302 @@
 // Write to MBTiles (sqlite) database
 // (note that sqlite_modern_cpp.h is very slightly changed from the original, for blob support and an .init method)
+//
+// Tiles are handed to a writer thread through a bounded queue, so tile generation doesn't wait on SQLite.
+// The writer reuses prepared statements and commits every COMMIT_BATCH tiles.
+//
+// In bulk-load mode (new files only), journalling is off, and the tables are created without their
+// unique indices, which are built in one go when the file is closed.
+//
+// Output can also be split across several shard files, written in parallel, then merged into one.
+//
+// When re-rendering into an existing file, a hash of each tile already there can be read first,
+// so that only tiles which have changed are written, and those no longer generated are deleted.
 
 class MBTiles { public:
 
+	static const uint QUEUE_SIZE = 1000;		// tiles waiting to be written before saveTile blocks
+	static const uint COMMIT_BATCH = 10000;		// tiles per transaction
+
 	database db;
+	bool deduplicate = false;				// use the map/images schema, storing identical tiles once
+	unordered_set<string> writtenImages;	//  | hashes of tiles already in the images table
+	bool bulkLoad = false;					// defer indexing until close()
+	bool vacuum = false;					// VACUUM on close()
+	bool indexOnClose = true;				// (bulk-load mode) build the unique indices on close()
 
 	MBTiles() {
 	}
 
 	~MBTiles() {
-		if (db) db << "COMMIT;"; // commit all the changes if open
+		try { close(); } catch (exception &e) { cerr << "Error writing .mbtiles: " << e.what() << endl; }
 	}
 
-	void open(string *filename) {
+	void open(string *filename, bool dedup = false, bool bulk = false) {
+		deduplicate = dedup;
+		bulkLoad = bulk;
+		if (bulkLoad && boost::filesystem::exists(*filename)) {
+			cerr << *filename << " already exists, so can't be bulk-loaded; writing it normally" << endl;
+			bulkLoad = false;
+		}
 		db.init(*filename);
+		// an existing file keeps its own schema, whatever the deduplicate setting
+		// (tiles written to the other one would never be read)
+		bool existingMap = hasTable("map"), existingTiles = hasTable("tiles");
+		if ((existingMap && !deduplicate) || (existingTiles && deduplicate)) {
+			cerr << *filename << (existingMap ? " stores identical tiles once" : " stores each tile separately")
+			     << ", so writing it that way, whatever the deduplicate setting" << endl;
+			deduplicate = existingMap;
+		}
 		db << "PRAGMA synchronous = OFF;";
+		if (bulkLoad) {
+			db << "PRAGMA page_size = 65536;";
+			db.prepare("PRAGMA journal_mode = OFF;").execute();		// (these two return a row, so
+			db.prepare("PRAGMA locking_mode = EXCLUSIVE;").execute();	//  can't go through operator<<)
+			db << "PRAGMA cache_size = -262144;";	// 256MB
+		}
+		// in bulk-load mode, unique constraints are added by close()
+		string unique = bulkLoad ? "" : ", UNIQUE (zoom_level, tile_column, tile_row)";
 		db << "CREATE TABLE IF NOT EXISTS metadata (name text, value text, UNIQUE (name));";
-		db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob, UNIQUE (zoom_level, tile_column, tile_row));";
-		db << "BEGIN;"; // begin a transaction
+		if (deduplicate) {
+			db << "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id text" + unique + ");";
+			db << "CREATE TABLE IF NOT EXISTS images (tile_id text, tile_data blob" + string(bulkLoad ? "" : ", UNIQUE (tile_id)") + ");";
+			db << "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+			insertImage = db.prepare("INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES (?,?);");
+			insertTile = db.prepare("REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?,?,?,?);");
+			removeTile = db.prepare("DELETE FROM map WHERE zoom_level=? AND tile_column=? AND tile_row=?;");
+			// (replacing a tile already in the file can leave its old image unused)
+			statement existing = db.prepare("SELECT 1 FROM map LIMIT 1;");
+			if (existing.fetch()) { pruneImages = true; }
+			existing.reset();
+		} else {
+			db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob" + unique + ");";
+			insertTile = db.prepare("REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+			removeTile = db.prepare("DELETE FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;");
+		}
 	}
-	
+
+	// (metadata must be written before the first tile is saved)
 	void writeMetadata(string key, string value) {
 		db << "REPLACE INTO metadata (name,value) VALUES (?,?);" << key << value;
 	}
-	
+
+	// Queue a tile to be written
 	void saveTile(int zoom, int x, int y, string *data) {
-		int tmsY = pow(2,zoom) - 1 - y;
-		db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);" << zoom << x << tmsY && *data;
+		if (!writer.joinable()) { writer = thread(&MBTiles::writeQueue, this); }
+		unique_lock<mutex> lock(queueMutex);
+		queueNotFull.wait(lock, [&]{ return queue.size() < QUEUE_SIZE || writerError; });
+		if (writerError) { rethrow_exception(writerError); }
+		queue.push_back(PendingTile { zoom, x, y, *data, false });
+		queueNotEmpty.notify_one();
+	}
+
+	// Queue a tile to be removed (e.g. when an update leaves it empty)
+	void deleteTile(int zoom, int x, int y) {
+		if (!writer.joinable()) { writer = thread(&MBTiles::writeQueue, this); }
+		unique_lock<mutex> lock(queueMutex);
+		queueNotFull.wait(lock, [&]{ return queue.size() < QUEUE_SIZE || writerError; });
+		if (writerError) { rethrow_exception(writerError); }
+		queue.push_back(PendingTile { zoom, x, y, "", true });
+		queueNotEmpty.notify_one();
+	}
+
+	// Read a hash of every tile already in the file, so that unchanged tiles needn't be written again
+	// (must be called before any tiles are saved)
+	void readExistingTiles() {
+		statement query = db.prepare("SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles;");
+		while (query.fetch()) {
+			int zoom = query.get_int(0);
+			int y = (1 << zoom) - 1 - query.get_int(2);
+			existingTiles[existingTileKey(zoom, query.get_int(1), y)] = murmur_hash64(query.get_blob(3), 0);
+		}
+		query.reset();
+	}
+
+	// Is this tile the same as the one already in the file?
+	// (either way, it's been generated, so won't be deleted by deleteRemaining)
+	bool unchanged(int zoom, int x, int y, const string &data) {
+		auto found = existingTiles.find(existingTileKey(zoom, x, y));
+		if (found == existingTiles.end()) { return false; }
+		bool same = found->second == murmur_hash64(data, 0);
+		existingTiles.erase(found);
+		return same;
+	}
+
+	// Delete the existing tiles that haven't been generated this time, if fn(zoom,x,y) agrees
+	template <typename F>
+	uint64_t deleteRemaining(F fn) {
+		uint64_t deleted = 0;
+		for (auto &it : existingTiles) {
+			uint zoom = 0;
+			while ((it.first >> (2*zoom+2)) != 0) { zoom++; }
+			TileKey key = it.first & ~(uint64_t(1) << (2*zoom));
+			if (!fn(zoom, tileKeyX(key), tileKeyY(key))) { continue; }
+			deleteTile(zoom, tileKeyX(key), tileKeyY(key));
+			deleted++;
+		}
+		existingTiles.clear();
+		return deleted;
+	}
+
+	// Wait for all queued tiles to be written, commit, and finish off the file
+	void close() {
+		if (!db || closed) { return; }
+		closed = true;
+		if (writer.joinable()) {
+			{
+				lock_guard<mutex> lock(queueMutex);
+				closing = true;
+				queueNotEmpty.notify_one();
+			}
+			writer.join();
+			if (writerError) { rethrow_exception(writerError); }
+		}
+		if (deduplicate && pruneImages) {
+			// remove images that no tile uses any more
+			db << "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);";
+		}
+		if (bulkLoad && indexOnClose) {
+			cout << "Indexing .mbtiles" << endl;
+			if (deduplicate) {
+				db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row);";
+				db << "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);";
+			} else {
+				db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);";
+			}
+			db << "ANALYZE;";
+		}
+		if (vacuum) {
+			cout << "Vacuuming .mbtiles" << endl;
+			db << "VACUUM;";
+		}
+	}
+
+	// Does this (or an attached) database have the given table?
+	bool hasTable(const string &name, const string &schema = "main") {
+		statement query = db.prepare("SELECT 1 FROM " + schema + ".sqlite_master WHERE type='table' AND name=?;");
+		query << name;
+		bool found = query.fetch();
+		query.reset();
+		return found;
+	}
+
+	// Copy all tiles (and metadata) from another .mbtiles file into this one, in index order
+	// (must be called before any tiles are saved)
+	void merge(const string &filename) {
+		db << "ATTACH DATABASE ? AS shard;" << filename;
+		db << "BEGIN;";
+		db << "REPLACE INTO metadata (name,value) SELECT name,value FROM shard.metadata;";
+		if (deduplicate && hasTable("images", "shard")) {
+			// (in bulk-load mode there's no unique index yet, so check for existing images explicitly)
+			db << "INSERT OR IGNORE INTO images (tile_id, tile_data) SELECT tile_id, tile_data FROM shard.images WHERE tile_id NOT IN (SELECT tile_id FROM main.images) ORDER BY tile_id;";
+			db << "INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) SELECT zoom_level, tile_column, tile_row, tile_id FROM shard.map ORDER BY zoom_level, tile_column, tile_row;";
+		} else if (deduplicate) {
+			// tiles need hashing on the way in
+			statement query = db.prepare("SELECT zoom_level, tile_column, tile_row, tile_data FROM shard.tiles ORDER BY zoom_level, tile_column, tile_row;");
+			while (query.fetch()) {
+				int zoom = query.get_int(0);
+				int y = (1 << zoom) - 1 - query.get_int(2);
+				insertQueuedTile(PendingTile { zoom, query.get_int(1), y, query.get_blob(3), false });
+			}
+		} else {
+			db << "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) SELECT zoom_level, tile_column, tile_row, tile_data FROM shard.tiles ORDER BY zoom_level, tile_column, tile_row;";
+		}
+		db << "COMMIT;";
+		db << "DETACH DATABASE shard;";
+	}
+
+	// Does an existing .mbtiles file use the map/images schema?
+	// (opened read-only, so a mistyped filename isn't created as an empty file)
+	static bool isDeduplicated(const string &filename) {
+		sqlite3 *handle = nullptr;
+		if (sqlite3_open_v2(filename.c_str(), &handle, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+			sqlite3_close(handle);
+			throw runtime_error("Couldn't open " + filename);
+		}
+		bool found = false;
+		try {
+			database source(handle);
+			statement query = source.prepare("SELECT 1 FROM sqlite_master WHERE type='table' AND name='images';");
+			found = query.fetch();
+			query.reset();
+		} catch (...) { sqlite3_close(handle); throw; }
+		sqlite3_close(handle);
+		return found;
+	}
+
+	// Name of the nth shard file for an output file: tiles.mbtiles -> tiles.shard0.mbtiles
+	static string shardFilename(const string &filename, uint shard) {
+		boost::filesystem::path path(filename);
+		return (path.parent_path() / (path.stem().string() + ".shard" + to_string(shard) + path.extension().string())).string();
+	}
+
+private:
+	struct PendingTile {
+		int zoom, x, y;
+		string data;
+		bool remove;
+	};
+
+	statement insertTile, insertImage, removeTile;
+	thread writer;
+	mutex queueMutex;
+	condition_variable queueNotEmpty, queueNotFull;
+	deque<PendingTile> queue;
+	bool closing = false;
+	bool closed = false;
+	exception_ptr writerError;
+	bool pruneImages = false;							// tiles may have been removed or replaced, leaving unused images
+	unordered_map<uint64_t, uint64_t> existingTiles;	// tiles already in the file -> hash of their data
+
+	// (a marker bit above the Morton key keeps zoom levels apart)
+	static uint64_t existingTileKey(uint zoom, uint x, uint y) { return (uint64_t(1) << (2*zoom)) | tileKey(x, y); }
+
+	// Writer thread: take tiles off the queue and insert them in batched transactions
+	void writeQueue() {
+		uint inBatch = 0;
+		try {
+			while (true) {
+				PendingTile tile;
+				{
+					unique_lock<mutex> lock(queueMutex);
+					queueNotEmpty.wait(lock, [&]{ return !queue.empty() || closing; });
+					if (queue.empty()) { break; }
+					tile = move(queue.front());
+					queue.pop_front();
+					queueNotFull.notify_one();
+				}
+				if (inBatch==0) { db << "BEGIN;"; }
+				insertQueuedTile(tile);
+				if (++inBatch == COMMIT_BATCH) { db << "COMMIT;"; inBatch = 0; }
+			}
+			if (inBatch>0) { db << "COMMIT;"; }
+		} catch (...) {
+			lock_guard<mutex> lock(queueMutex);
+			writerError = current_exception();
+			queueNotFull.notify_all();
+		}
+	}
+
+	void insertQueuedTile(const PendingTile &tile) {
+		int tmsY = (1 << tile.zoom) - 1 - tile.y;
+		if (tile.remove) {
+			// (in the map/images schema, the image stays for now, as other tiles may share it;
+			//  unused images are removed by close())
+			removeTile << tile.zoom << tile.x << tmsY;
+			pruneImages = true;
+			removeTile.execute();
+			return;
+		}
+		if (deduplicate) {
+			string tileId = content_hash(tile.data);
+			if (writtenImages.insert(tileId).second) {
+				insertImage << tileId && tile.data;
+				insertImage.execute();
+			}
+			insertTile << tile.zoom << tile.x << tmsY << tileId;
+		} else {
+			insertTile << tile.zoom << tile.x << tmsY && tile.data;
+		}
+		insertTile.execute();
 	}
 };
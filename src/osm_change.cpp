@@ -0,0 +1,436 @@
+/*
+	Incremental updates from OSM change files (.osc)
+
+	UpdateState keeps what's needed to apply changes to a previous run: the Lua output of each
+	node and way, and the pseudo IDs given to multipolygon relations. Together with the OSM
+	store, it's saved as a snapshot after a full run (--save-snapshot), and loaded instead of
+	reading a .pbf (--load-snapshot).
+
+	Applying a change file takes the old contributions of everything it touches out of the
+	tile index, updates the store, runs Lua on the changed objects, and adds them back. The
+	base-zoom tiles touched along the way are returned, so only those need rendering again.
+
+	Lua is only run again for objects in the change file. A way whose nodes move keeps its
+	existing output (with the new geometry and bbox), and so does a relation when a member way changes.
+	Relation members need to be in the store (i.e. output before) or in the change file.
+*/
+
+class UpdateState { public:
+
+	static constexpr const char *MAGIC = "tilemaker snapshot 1\n";
+
+	OSMStore &osmStore;
+	map< WayID, vector<OutputObject> > &relationOutputObjects;
+	map< WayID, vector<WayID> > &wayRelations;
+
+	bool recording = false;							// keep Lua output while reading .pbfs, for a snapshot
+	unordered_map< NodeID, vector<OutputObject> > nodeOutputs;
+	unordered_map< WayID, vector<OutputObject> > wayOutputs;
+	unordered_map< uint64_t, WayID > relationIDs;	// OSM relation ID -> pseudo way ID
+	uint32_t newWayID = MAX_WAY_ID;					// next pseudo way ID (counting down)
+	Box clippingBox;
+	bool hasClippingBox = false;
+
+	UpdateState(OSMStore &store, map< WayID, vector<OutputObject> > &relOutputs, map< WayID, vector<WayID> > &wayRels) :
+		osmStore(store), relationOutputObjects(relOutputs), wayRelations(wayRels) {
+	}
+
+	// ----	Snapshots
+
+	void save(const string &filename) const {
+		ofstream out(filename, ios::out | ios::trunc | ios::binary);
+		out << MAGIC;
+		write_raw(out, newWayID);
+		write_raw<uint8_t>(out, hasClippingBox);
+		for (double v : { clippingBox.min_corner().get<0>(), clippingBox.min_corner().get<1>(),
+		                  clippingBox.max_corner().get<0>(), clippingBox.max_corner().get<1>() }) { write_raw(out, v); }
+
+		osmStore.save(out);
+		writeOutputs(out, nodeOutputs);
+		writeOutputs(out, wayOutputs);
+		writeOutputs(out, relationOutputObjects);
+		write_raw<uint64_t>(out, wayRelations.size());
+		for (auto &it : wayRelations) { write_raw(out, it.first); write_vector(out, it.second); }
+		write_raw<uint64_t>(out, relationIDs.size());
+		for (auto &it : relationIDs) { write_raw(out, it.first); write_raw(out, it.second); }
+
+		out.close();
+		if (!out) { throw runtime_error("Couldn't write snapshot " + filename); }
+	}
+
+	void load(const string &filename) {
+		ifstream in(filename, ios::in | ios::binary);
+		if (!in) { throw runtime_error("Couldn't open snapshot " + filename); }
+		string magic(strlen(MAGIC), 0);
+		in.read(&magic[0], magic.size());
+		if (magic != MAGIC) { throw runtime_error(filename + " isn't a tilemaker snapshot"); }
+		newWayID = read_raw<uint32_t>(in);
+		hasClippingBox = read_raw<uint8_t>(in);
+		double minLon = read_raw<double>(in), minLatp = read_raw<double>(in);
+		double maxLon = read_raw<double>(in), maxLatp = read_raw<double>(in);
+		clippingBox = Box(geom::make<Point>(minLon, minLatp), geom::make<Point>(maxLon, maxLatp));
+
+		osmStore.load(in);
+		readOutputs(in, nodeOutputs);
+		readOutputs(in, wayOutputs);
+		readOutputs(in, relationOutputObjects);
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			WayID id = read_raw<WayID>(in);
+			wayRelations[id] = read_vector<WayID>(in);
+		}
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			uint64_t id = read_raw<uint64_t>(in);
+			relationIDs[id] = read_raw<WayID>(in);
+		}
+	}
+
+	// Put everything from the snapshot back into the tile index
+	void rebuildTileIndex(map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom) {
+		set<TileKey> touched;
+		for (auto &it : nodeOutputs) { contributeNode(it.first, tileIndex, baseZoom, touched, true); }
+		osmStore.ways.for_each([&](WayID id, const NodeVec &) { contributeWay(id, tileIndex, baseZoom, touched, true); });
+	}
+
+	// ----	Applying changes
+
+	// Apply an .osc file, returning the base-zoom tiles affected
+	set<TileKey> applyChanges(const string &filename, OSMObject &osmObject, const unordered_set<string> &nodeKeys,
+	                          map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom) {
+		// Read the changes (a later change to the same object replaces an earlier one)
+		map<NodeID, ChangedNode> changedNodes;
+		map<WayID, ChangedWay> changedWays;
+		map<uint64_t, ChangedRelation> changedRelations;
+		readChanges(filename, changedNodes, changedWays, changedRelations);
+		cout << "Applying " << filename << ": " << changedNodes.size() << " nodes, " << changedWays.size() << " ways, "
+		     << changedRelations.size() << " relations" << endl;
+
+		// Find everything affected: changed ways, ways with changed nodes, and members of changed relations
+		buildNodeWays();
+		set<WayID> affectedWays;
+		for (auto &it : changedWays) { affectedWays.insert(it.first); }
+		for (auto &it : changedNodes) {
+			auto found = nodeWays.find(it.first);
+			if (found != nodeWays.end()) { affectedWays.insert(found->second.begin(), found->second.end()); }
+		}
+		for (auto &it : changedRelations) {
+			auto found = relationIDs.find(it.first);
+			if (found != relationIDs.end() && osmStore.relations.count(found->second)) {
+				WayList<RelationStoreIterator> wayList = osmStore.relations.at(found->second);
+				affectedWays.insert(wayList.outerBegin, wayList.outerEnd);
+				affectedWays.insert(wayList.innerBegin, wayList.innerEnd);
+			}
+			for (auto &member : it.second.members) { affectedWays.insert(member.first); }
+		}
+
+		// Take their old output out of the tile index
+		set<TileKey> touched;
+		for (auto wayId : affectedWays) { contributeWay(wayId, tileIndex, baseZoom, touched, false); }
+		for (auto &it : changedNodes) { contributeNode(it.first, tileIndex, baseZoom, touched, false); }
+
+		// Update the store, and run Lua on the changed objects
+		for (auto &it : changedNodes) { applyNode(it.first, it.second, osmObject, nodeKeys); }
+		set<WayID> relationMembers;		// (ways to keep even if they have no output of their own)
+		for (auto &it : changedRelations) {
+			for (auto &member : it.second.members) { relationMembers.insert(member.first); }
+		}
+		for (auto &it : changedWays) { applyWay(it.first, it.second, osmObject, relationMembers); }
+		for (auto &it : changedRelations) { applyRelation(it.first, it.second, osmObject); }
+
+		// Lua isn't run again when only a way's nodes moved, so bring its bboxes up to date
+		for (auto wayId : affectedWays) { updateBboxes(wayId); }
+
+		// And put them back
+		for (auto wayId : affectedWays) { contributeWay(wayId, tileIndex, baseZoom, touched, true); }
+		for (auto &it : changedNodes) { contributeNode(it.first, tileIndex, baseZoom, touched, true); }
+		return touched;
+	}
+
+private:
+	typedef vector< pair<string, string> > Tags;
+	struct ChangedNode { bool deleted; LatpLon ll; Tags tags; };
+	struct ChangedWay { bool deleted; NodeVec nodeVec; Tags tags; };
+	struct ChangedRelation { bool deleted; vector< pair<WayID, bool> > members; Tags tags; };	// (way ID, is inner)
+
+	unordered_map< NodeID, vector<WayID> > nodeWays;	// ways each stored node is in
+	bool nodeWaysBuilt = false;
+
+	template <typename M>
+	static void writeOutputs(ostream &out, const M &outputs) {
+		write_raw<uint64_t>(out, outputs.size());
+		for (auto &it : outputs) {
+			write_raw<uint64_t>(out, it.first);
+			write_raw<uint32_t>(out, it.second.size());
+			for (auto &oo : it.second) { oo.write(out); }
+		}
+	}
+	template <typename M>
+	static void readOutputs(istream &in, M &outputs) {
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			auto &list = outputs[read_raw<uint64_t>(in)];
+			for (uint32_t m = read_raw<uint32_t>(in); m>0; m--) { list.push_back(OutputObject::read(in)); }
+		}
+	}
+
+	// Add (or remove) a way's output, and that of any relations it's in, to the tiles it passes through
+	void contributeWay(WayID wayId, map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom, set<TileKey> &touched, bool add) {
+		if (!osmStore.ways.count(wayId)) { return; }
+		vector<OutputObject> outputs;
+		auto own = wayOutputs.find(wayId);
+		if (own != wayOutputs.end()) { outputs = own->second; }
+		auto rels = wayRelations.find(wayId);
+		if (rels != wayRelations.end()) {
+			for (auto relID : rels->second) {
+				auto relOutputs = relationOutputObjects.find(relID);
+				if (relOutputs != relationOutputObjects.end()) { outputs.insert(outputs.end(), relOutputs->second.begin(), relOutputs->second.end()); }
+			}
+		}
+		if (outputs.empty()) { return; }
+		for (auto index : osmStore.nodeListTiles(wayId, baseZoom)) {
+			contribute(index, outputs, tileIndex, add);
+			touched.insert(index);
+		}
+	}
+
+	void contributeNode(NodeID nodeId, map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom, set<TileKey> &touched, bool add) {
+		auto outputs = nodeOutputs.find(nodeId);
+		if (outputs == nodeOutputs.end() || !osmStore.nodes.count(nodeId)) { return; }
+		TileKey index = latpLon2index(osmStore.nodes.at(nodeId), baseZoom);
+		contribute(index, outputs->second, tileIndex, add);
+		touched.insert(index);
+	}
+
+	// (the tile index keeps duplicates until tiles are written, so remove just one copy of each)
+	static void contribute(TileKey index, const vector<OutputObject> &outputs, map< TileKey, vector<OutputObject> > &tileIndex, bool add) {
+		if (add) {
+			auto &ooList = tileIndex[index];
+			ooList.insert(ooList.end(), outputs.begin(), outputs.end());
+			return;
+		}
+		auto tile = tileIndex.find(index);
+		if (tile == tileIndex.end()) { return; }
+		for (auto &oo : outputs) {
+			auto found = find(tile->second.begin(), tile->second.end(), oo);
+			if (found != tile->second.end()) { tile->second.erase(found); }
+		}
+		if (tile->second.empty()) { tileIndex.erase(tile); }
+	}
+
+	// Recalculate the bbox of a way's output, and that of any relations it's in, from the current nodes
+	void updateBboxes(WayID wayId) {
+		if (!osmStore.ways.count(wayId)) { return; }
+		auto own = wayOutputs.find(wayId);
+		if (own != wayOutputs.end()) {
+			LatpLonBox bbox = waysBbox(WayVec { wayId });
+			for (auto &oo : own->second) { oo.bbox = bbox; }
+		}
+		auto rels = wayRelations.find(wayId);
+		if (rels == wayRelations.end()) { return; }
+		for (auto relID : rels->second) {
+			auto relOutputs = relationOutputObjects.find(relID);
+			if (relOutputs == relationOutputObjects.end() || !osmStore.relations.count(relID)) { continue; }
+			WayList<RelationStoreIterator> wayList = osmStore.relations.at(relID);
+			LatpLonBox bbox = waysBbox(WayVec(wayList.outerBegin, wayList.outerEnd));
+			for (auto &oo : relOutputs->second) { oo.bbox = bbox; }
+		}
+	}
+
+	// (as OSMObject::bbox)
+	LatpLonBox waysBbox(const WayVec &wayVec) const {
+		LatpLonBox bbox;
+		for (auto wayId : wayVec) {
+			if (!osmStore.ways.count(wayId)) { continue; }
+			NodeList<WayStoreIterator> nodeList = osmStore.ways.at(wayId);
+			for (auto it = nodeList.begin; it != nodeList.end; ++it) {
+				if (osmStore.nodes.count(*it)) { bbox.expand(osmStore.nodes.at(*it)); }
+			}
+		}
+		return bbox;
+	}
+
+	void buildNodeWays() {
+		if (nodeWaysBuilt) { return; }
+		nodeWaysBuilt = true;
+		osmStore.ways.for_each([&](WayID wayId, const NodeVec &nodeVec) {
+			for (auto nodeId : nodeVec) { nodeWays[nodeId].push_back(wayId); }
+		});
+	}
+
+	void setNodeWays(WayID wayId, const NodeVec &nodeVec, bool add) {
+		for (auto nodeId : nodeVec) {
+			auto &list = nodeWays[nodeId];
+			if (add) { list.push_back(wayId); }
+			else { list.erase(remove(list.begin(), list.end(), wayId), list.end()); }
+		}
+	}
+
+	void applyNode(NodeID nodeId, const ChangedNode &change, OSMObject &osmObject, const unordered_set<string> &nodeKeys) {
+		osmStore.nodes.erase(nodeId);
+		nodeOutputs.erase(nodeId);
+		if (change.deleted) { return; }
+		osmStore.nodes.insert(nodeId, change.ll);
+
+		bool significant = false;
+		for (auto &tag : change.tags) { if (nodeKeys.count(tag.first)) { significant = true; } }
+		if (!significant) { return; }
+		PrimitiveBlock pb;
+		DenseNodes dense;
+		vector<uint32_t> keys, vals;
+		setStringTable(osmObject, pb, change.tags, keys, vals);
+		for (uint i=0; i<keys.size(); i++) { dense.add_keys_vals(keys[i]); dense.add_keys_vals(vals[i]); }
+		dense.add_keys_vals(0);
+		osmObject.setNode(nodeId, &dense, 0, keys.size()*2, change.ll);
+		callLua(osmObject, "node_function");
+		if (!osmObject.empty()) { nodeOutputs[nodeId] = osmObject.outputs; }
+	}
+
+	void applyWay(WayID wayId, const ChangedWay &change, OSMObject &osmObject, const set<WayID> &relationMembers) {
+		if (osmStore.ways.count(wayId)) {
+			NodeList<WayStoreIterator> old = osmStore.ways.at(wayId);
+			setNodeWays(wayId, NodeVec(old.begin, old.end), false);
+			osmStore.ways.erase(wayId);
+		}
+		wayOutputs.erase(wayId);
+		if (change.deleted || change.nodeVec.empty()) { return; }
+		for (auto nodeId : change.nodeVec) {
+			if (!osmStore.nodes.count(nodeId)) { cerr << "Way " << wayId << " has unknown node " << nodeId << ", skipping" << endl; return; }
+		}
+
+		PrimitiveBlock pb;
+		Way pbfWay;
+		vector<uint32_t> keys, vals;
+		setStringTable(osmObject, pb, change.tags, keys, vals);
+		pbfWay.set_id(wayId);
+		for (uint i=0; i<keys.size(); i++) { pbfWay.add_keys(keys[i]); pbfWay.add_vals(vals[i]); }
+		NodeVec nodeVec = change.nodeVec;
+		osmObject.setWay(&pbfWay, &nodeVec);
+		callLua(osmObject, "way_function");
+
+		// Keep it if it's output, or if a relation needs it
+		if (osmObject.empty() && !wayRelations.count(wayId) && !relationMembers.count(wayId)) { return; }
+		if (!osmObject.empty()) { wayOutputs[wayId] = osmObject.outputs; }
+		osmStore.ways.insert(wayId, nodeVec);
+		setNodeWays(wayId, nodeVec, true);
+	}
+
+	void applyRelation(uint64_t relationId, const ChangedRelation &change, OSMObject &osmObject) {
+		// Remove the old relation
+		WayID relID = 0;
+		auto found = relationIDs.find(relationId);
+		if (found != relationIDs.end()) {
+			relID = found->second;
+			if (osmStore.relations.count(relID)) {
+				WayList<RelationStoreIterator> wayList = osmStore.relations.at(relID);
+				WayVec members(wayList.outerBegin, wayList.outerEnd);
+				members.insert(members.end(), wayList.innerBegin, wayList.innerEnd);
+				setWayRelations(relID, members, false);
+				osmStore.relations.erase(relID);
+			}
+			relationOutputObjects.erase(relID);
+			relationIDs.erase(found);
+		}
+		if (change.deleted) { return; }
+		bool multipolygon = false;
+		for (auto &tag : change.tags) { if (tag.first=="type" && tag.second=="multipolygon") { multipolygon = true; } }
+		if (!multipolygon) { return; }
+
+		// Run Lua on the new one
+		WayVec outerWayVec, innerWayVec;
+		for (auto &member : change.members) {
+			if (!osmStore.ways.count(member.first)) {
+				cerr << "Relation " << relationId << " has member way " << member.first << " that isn't available, skipping" << endl;
+				return;
+			}
+			(member.second ? innerWayVec : outerWayVec).push_back(member.first);
+		}
+		PrimitiveBlock pb;
+		Relation pbfRelation;
+		vector<uint32_t> keys, vals;
+		setStringTable(osmObject, pb, change.tags, keys, vals);
+		pbfRelation.set_id(relationId);
+		for (uint i=0; i<keys.size(); i++) { pbfRelation.add_keys(keys[i]); pbfRelation.add_vals(vals[i]); }
+		osmObject.setRelation(&pbfRelation, &outerWayVec, &innerWayVec, relID);
+		callLua(osmObject, "way_function");
+		if (osmObject.empty()) { return; }
+
+		relID = osmObject.osmID;
+		relationIDs[relationId] = relID;
+		osmStore.relations.insert_front(relID, outerWayVec, innerWayVec);
+		relationOutputObjects[relID] = osmObject.outputs;
+		WayVec members(outerWayVec);
+		members.insert(members.end(), innerWayVec.begin(), innerWayVec.end());
+		setWayRelations(relID, members, true);
+	}
+
+	void setWayRelations(WayID relID, const WayVec &members, bool add) {
+		for (auto wayId : members) {
+			if (add) { wayRelations[wayId].push_back(relID); continue; }
+			auto found = wayRelations.find(wayId);
+			if (found == wayRelations.end()) { continue; }
+			found->second.erase(remove(found->second.begin(), found->second.end(), relID), found->second.end());
+			if (found->second.empty()) { wayRelations.erase(found); }
+		}
+	}
+
+	// Give Lua a set of tags as if they'd come from a .pbf block
+	static void setStringTable(OSMObject &osmObject, PrimitiveBlock &pb, const Tags &tags, vector<uint32_t> &keys, vector<uint32_t> &vals) {
+		StringTable *st = pb.mutable_stringtable();
+		st->add_s("");
+		for (auto &tag : tags) {
+			keys.push_back(st->s_size()); st->add_s(tag.first);
+			vals.push_back(st->s_size()); st->add_s(tag.second);
+		}
+		osmObject.readStringTable(&pb);
+	}
+
+	static void callLua(OSMObject &osmObject, const char *function) {
+		try { luabind::call_function<int>(osmObject.luaState, function, &osmObject);
+		} catch (const luabind::error &er) {
+			throw runtime_error(string(er.what()) + " -- " + lua_tostring(er.state(), -1));
+		}
+	}
+
+	// Parse an .osc file
+	static void readChanges(const string &filename, map<NodeID, ChangedNode> &nodes, map<WayID, ChangedWay> &ways, map<uint64_t, ChangedRelation> &relations) {
+		boost::property_tree::ptree tree;
+		boost::property_tree::read_xml(filename, tree);
+		for (auto &action : tree.get_child("osmChange")) {
+			if (action.first != "create" && action.first != "modify" && action.first != "delete") { continue; }
+			bool deleted = action.first == "delete";
+			for (auto &element : action.second) {
+				if (element.first == "<xmlattr>") { continue; }
+				const boost::property_tree::ptree &e = element.second;
+				uint64_t id = e.get<uint64_t>("<xmlattr>.id");
+				Tags tags;
+				for (auto &child : e) {
+					if (child.first == "tag") { tags.emplace_back(child.second.get<string>("<xmlattr>.k"), child.second.get<string>("<xmlattr>.v")); }
+				}
+				if (element.first == "node") {
+					ChangedNode &n = nodes[id];
+					n.deleted = deleted;
+					n.tags = tags;
+					if (!deleted) {
+						double lat = e.get<double>("<xmlattr>.lat"), lon = e.get<double>("<xmlattr>.lon");
+						n.ll = LatpLon { int(lat2latp(lat)*10000000.0), int(lon*10000000.0) };
+					}
+				} else if (element.first == "way") {
+					ChangedWay &w = ways[id];
+					w.deleted = deleted;
+					w.tags = tags;
+					w.nodeVec.clear();
+					for (auto &child : e) {
+						if (child.first == "nd") { w.nodeVec.push_back(child.second.get<NodeID>("<xmlattr>.ref")); }
+					}
+				} else if (element.first == "relation") {
+					ChangedRelation &r = relations[id];
+					r.deleted = deleted;
+					r.tags = tags;
+					r.members.clear();
+					for (auto &child : e) {
+						if (child.first != "member" || child.second.get<string>("<xmlattr>.type") != "way") { continue; }
+						r.members.emplace_back(child.second.get<WayID>("<xmlattr>.ref"), child.second.get<string>("<xmlattr>.role", "") == "inner");
+					}
+				}
+			}
+		}
+	}
+};
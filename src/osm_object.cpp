@@ -1,3 +1,5 @@
+enum PointThinning { THIN_NONE, THIN_GRID, THIN_PRIORITY };
+
 struct LayerDef {
 	string name;
 	int minzoom;
@@ -6,6 +8,11 @@ struct LayerDef {
 	double simplifyLevel;
 	double simplifyLength;
 	double simplifyRatio;
+	double minAreaPixels;
+	double minLengthPixels;
+	PointThinning thinPoints;
+	double thinPointsCell;			// grid cell size in pixels
+	string clusterCount;			// attribute to store the number of points merged into each one
 };
 
 /*
@@ -38,12 +45,15 @@ class OSMObject { public:
 	bool polygonInited;
 	MultiPolygon multiPolygonCache;
 	bool multiPolygonInited;
+	LatpLonBox bboxCache;
+	bool bboxInited;
 
 	vector<LayerDef> layers;				// List of layers
 	map<string,uint> layerMap;				// Layer->position map
 	vector<vector<uint>> layerOrder;		// Order of (grouped) layers, e.g. [ [0], [1,2,3], [4] ]
 
 	vector<OutputObject> outputs;			// All output objects
+	bool autoInteger = false;				// Store integral AttributeNumeric values as integers
 
 	// Common tag storage
 	vector<string> stringTable;				// Tag table from the current PrimitiveGroup
@@ -70,12 +80,10 @@ class OSMObject { public:
 	}
 
 	// Define a layer (as read from the .json file)
-	uint addLayer(string name, int minzoom, int maxzoom,
-			int simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, string writeTo) {
-		LayerDef layer = { name, minzoom, maxzoom, simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio };
+	uint addLayer(const LayerDef &layer, string writeTo) {
 		layers.push_back(layer);
 		uint layerNum = layers.size()-1;
-		layerMap[name] = layerNum;
+		layerMap[layer.name] = layerNum;
 
 		if (writeTo.empty()) {
 			vector<uint> r = { layerNum };
@@ -161,10 +169,11 @@ class OSMObject { public:
 
 	// We are now processing a relation
 	// (note that we store relations as ways with artificial IDs, and that
-	//  we use decrementing positive IDs to give a bit more space for way IDs)
-	inline void setRelation(Relation *relation, WayVec *outerWayVecPtr, WayVec *innerWayVecPtr) {
+	//  we use decrementing positive IDs to give a bit more space for way IDs;
+	//  a relation that already has one, when applying changes, can pass it in)
+	inline void setRelation(Relation *relation, WayVec *outerWayVecPtr, WayVec *innerWayVecPtr, WayID pseudoID = 0) {
 		reset();
-		osmID = --newWayID;
+		osmID = pseudoID ? pseudoID : --newWayID;
 		isWay = true;
 		isRelation = true;
 
@@ -183,6 +192,7 @@ class OSMObject { public:
 		linestringInited = false;
 		polygonInited = false;
 		multiPolygonInited = false;
+		bboxInited = false;
 	}
 
 	// Internal: set start/end co-ordinates
@@ -348,6 +358,28 @@ class OSMObject { public:
 		return multiPolygonCache;
 	}
 
+	// Bounding box of the nodes (or, for relations, the outer ways' nodes)
+	const LatpLonBox &bbox() {
+		if (!bboxInited) {
+			bboxInited = true;
+			bboxCache = LatpLonBox();
+			if (!isWay) {
+				bboxCache.expand(LatpLon { latp1, lon1 });
+			} else if (!isRelation) {
+				for (auto it : *nodeVec) { bboxCache.expand(osmStore->nodes.at(it)); }
+			} else {
+				for (auto wt : *outerWayVec) {
+					if (!osmStore->ways.count(wt)) { continue; }
+					NodeList<WayStoreIterator> nodeList = osmStore->ways.at(wt);
+					for (auto it = nodeList.begin; it != nodeList.end; ++it) {
+						if (osmStore->nodes.count(*it)) { bboxCache.expand(osmStore->nodes.at(*it)); }
+					}
+				}
+			}
+		}
+		return bboxCache;
+	}
+
 	// ----	Requests from Lua to write this way/node to a vector tile's Layer
 
 	// Add layer
@@ -358,6 +390,7 @@ class OSMObject { public:
 		OutputObject oo(isWay ? (area ? POLYGON : LINESTRING) : POINT,
 						layerMap[layerName],
 						osmID);
+		if (isWay) { oo.bbox = bbox(); }
 		outputs.push_back(oo);
 	}
 	void LayerAsCentroid(const string &layerName) {
@@ -381,9 +414,22 @@ class OSMObject { public:
 	void AttributeNumeric(const string &key, const float val) {
 		if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
 		vector_tile::Tile_Value v;
-		v.set_float_value(val);
+		if (autoInteger && val==floor(val) && fabs(val)<16777216) { setIntegerValue(v, int64_t(val)); }
+		else { v.set_float_value(val); }
 		outputs[outputs.size()-1].addAttribute(key, v);
 	}
+	void AttributeInteger(const string &key, const int val) {
+		if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
+		vector_tile::Tile_Value v;
+		setIntegerValue(v, val);
+		outputs[outputs.size()-1].addAttribute(key, v);
+	}
+	// Set the priority of the most recently written layer object
+	// (when a tile exceeds its size budget, the lowest-priority objects are dropped first)
+	void Priority(const float val) {
+		if (outputs.size()==0) { cerr << "Can't set Priority if no Layer set" << endl; return; }
+		outputs[outputs.size()-1].priority = val;
+	}
 	void AttributeBoolean(const string &key, const bool val) {
 		if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
 		vector_tile::Tile_Value v;
@@ -78,6 +78,25 @@ public:
 		mLatpLons.emplace(i, coord);
 	}
 
+	// @brief Insert a latp/lon pair in any order (e.g. nodes read back after the store is filled).
+	// @param i OSM ID of a node
+	// @param coord a latp/lon pair to be inserted
+	void insert(NodeID i, LatpLon coord) {
+		mLatpLons.emplace(i, coord);
+	}
+
+	// @brief Remove a latp/lon pair (when applying changes).
+	// @param i OSM ID of a node
+	void erase(NodeID i) {
+		mLatpLons.erase(i);
+	}
+
+	// @brief Call a function with each OSM ID and latp/lon pair (e.g. to save the store).
+	template<class F>
+	void for_each(F fn) const {
+		for (const auto &it : mLatpLons) { fn(it.first, it.second); }
+	}
+
 	// @brief Make the store empty
 	void clear() {
 		mLatpLons.clear();
@@ -117,6 +136,25 @@ public:
 		mNodeLists.emplace(i, nodeVec);
 	}
 
+	// @brief Insert a node list in any order (e.g. ways changed by an update).
+	// @param i OSM ID of a way
+	// @param nodeVec a node vector to be inserted
+	void insert(WayID i, const NodeVec &nodeVec) {
+		mNodeLists.emplace(i, nodeVec);
+	}
+
+	// @brief Remove a node list (when applying changes).
+	// @param i OSM ID of a way
+	void erase(WayID i) {
+		mNodeLists.erase(i);
+	}
+
+	// @brief Call a function with each OSM ID and node list (e.g. to save the store).
+	template<class F>
+	void for_each(F fn) const {
+		for (const auto &it : mNodeLists) { fn(it.first, it.second); }
+	}
+
 	// @brief Make the store empty
 	void clear() {
 		mNodeLists.clear();
@@ -158,6 +196,18 @@ public:
 		mOutInLists.emplace(i, make_pair(outerWayVec, innerWayVec));
 	}
 
+	// @brief Remove a way list (when applying changes).
+	// @param i Pseudo OSM ID of a relation
+	void erase(WayID i) {
+		mOutInLists.erase(i);
+	}
+
+	// @brief Call a function with each pseudo OSM ID, outer and inner way list (e.g. to save the store).
+	template<class F>
+	void for_each(F fn) const {
+		for (const auto &it : mOutInLists) { fn(it.first, it.second.first, it.second.second); }
+	}
+
 	// @brief Make the store empty
 	void clear() {
 		mOutInLists.clear();
@@ -172,6 +222,42 @@ struct OSMStore {
 	WayStore ways;
 	RelationStore relations;
 
+	// Write all the nodes, ways and relations to a binary file (for snapshots and saved indices)
+	void save(ostream &out) const {
+		uint64_t count = 0;
+		nodes.for_each([&](NodeID, LatpLon) { count++; });
+		write_raw(out, count);
+		nodes.for_each([&](NodeID id, LatpLon ll) { write_raw<uint64_t>(out, id); write_raw(out, ll); });
+		count = 0;
+		ways.for_each([&](WayID, const NodeVec &) { count++; });
+		write_raw(out, count);
+		ways.for_each([&](WayID id, const NodeVec &nodeVec) { write_raw(out, id); write_vector(out, nodeVec); });
+		count = 0;
+		relations.for_each([&](WayID, const WayVec &, const WayVec &) { count++; });
+		write_raw(out, count);
+		relations.for_each([&](WayID id, const WayVec &outer, const WayVec &inner) {
+			write_raw(out, id); write_vector(out, outer); write_vector(out, inner);
+		});
+	}
+
+	// Read them back in
+	void load(istream &in) {
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			NodeID id = read_raw<uint64_t>(in);
+			nodes.insert(id, read_raw<LatpLon>(in));
+		}
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			WayID id = read_raw<WayID>(in);
+			ways.insert(id, read_vector<NodeID>(in));
+		}
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			WayID id = read_raw<WayID>(in);
+			WayVec outer = read_vector<WayID>(in);
+			WayVec inner = read_vector<WayID>(in);
+			relations.insert_front(id, outer, inner);
+		}
+	}
+
 	// Relation -> MultiPolygon
 	template<class WayIt>
 	MultiPolygon wayListMultiPolygon(WayList<WayIt> wayList) const {
@@ -242,6 +328,43 @@ struct OSMStore {
 		return nodeListLinestring(makeNodeList(nodeVec));
 	}
 
+	// Way -> tiles it passes through
+	// (including any skipped over by long segments; nodes we don't have are ignored)
+	template<class NodeIt>
+	unordered_set<TileKey> nodeListTiles(NodeList<NodeIt> nodeList, uint zoom) const {
+		unordered_set<TileKey> tilelist;
+		bool first = true;
+		uint lastX = 0, lastY = 0;
+		LatpLon lastLL;
+		for (auto it = nodeList.begin; it != nodeList.end; ++it) {
+			if (!nodes.count(*it)) { continue; }
+			LatpLon ll = nodes.at(*it);
+			uint tileX =  lon2tilex(ll.lon  / 10000000.0, zoom);
+			uint tileY = latp2tiley(ll.latp / 10000000.0, zoom);
+			if (!first) {
+				// Check we're not skipping any tiles, and insert intermediate nodes if so
+				// (we should have a simple fill algorithm for polygons, too)
+				int dx = abs((int)tileX-(int)lastX);
+				int dy = abs((int)tileY-(int)lastY);
+				if (dx>1 || dy>1 || (dx==1 && dy==1)) {
+					insertIntermediateTiles(&tilelist, max(dx,dy), lastLL, ll, zoom);
+				}
+			}
+			tilelist.insert(tileKey(tileX, tileY));
+			first = false;
+			lastX = tileX; lastY = tileY; lastLL = ll;
+		}
+		return tilelist;
+	}
+
+	unordered_set<TileKey> nodeListTiles(WayID wayId, uint zoom) const {
+		return nodeListTiles(ways.at(wayId), zoom);
+	}
+
+	unordered_set<TileKey> nodeListTiles(const NodeVec &nodeVec, uint zoom) const {
+		return nodeListTiles(makeNodeList(nodeVec), zoom);
+	}
+
 private:
 	// helper
 	template<class PointRange, class NodeIt>
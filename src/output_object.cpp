@@ -46,12 +46,21 @@ public:
 	}
 };
 
+// Store an integer as a varint (zigzag-encoded if negative), which is both smaller and
+// easier to deduplicate than a float
+void setIntegerValue(vector_tile::Tile_Value &v, int64_t val) {
+	if (val >= 0) { v.set_uint_value(val); }
+	else          { v.set_sint_value(val); }
+}
+
 class OutputObject { public:
 
 	OutputGeometryType geomType;						// point, linestring, polygon...
 	uint_least8_t layer;								// what layer is it in?
 	NodeID objectID;									// id of way (linestring/polygon) or node (point)
 	map <string, vector_tile::Tile_Value> attributes;	// attributes
+	LatpLonBox bbox;									// bounding box of the source geometry (empty if unknown)
+	float priority = 0;									// higher = kept longer when a tile is over budget
 
 	OutputObject(OutputGeometryType type, uint_least8_t l, NodeID id) {
 		geomType = type;
@@ -63,12 +72,53 @@ class OutputObject { public:
 		attributes[key]=value;
 	}
 
+	// Save to/load from a binary file (e.g. a snapshot for incremental updates)
+	void write(ostream &out) const {
+		write_raw<uint8_t>(out, geomType);
+		write_raw<uint8_t>(out, layer);
+		write_raw<uint64_t>(out, objectID);
+		write_raw(out, bbox);
+		write_raw(out, priority);
+		write_raw<uint32_t>(out, attributes.size());
+		for (auto &it : attributes) {
+			write_string(out, it.first);
+			write_string(out, it.second.SerializeAsString());
+		}
+	}
+
+	static OutputObject read(istream &in) {
+		OutputGeometryType type = static_cast<OutputGeometryType>(read_raw<uint8_t>(in));
+		uint_least8_t l = read_raw<uint8_t>(in);
+		OutputObject oo(type, l, read_raw<uint64_t>(in));
+		oo.bbox = read_raw<LatpLonBox>(in);
+		oo.priority = read_raw<float>(in);
+		for (uint32_t n = read_raw<uint32_t>(in); n>0; n--) {
+			string key = read_string(in);
+			oo.attributes[key].ParseFromString(read_string(in));
+		}
+		return oo;
+	}
+
+	// Is the source geometry too small to be worth drawing at this zoom?
+	// (checked against the stored bbox, so no geometry needs to be built)
+	bool isTiny(uint zoom, double minAreaPixels, double minLengthPixels) const {
+		if (bbox.empty()) { return false; }
+		double px = pixelSize(zoom);
+		if ((geomType==POLYGON || geomType==CACHED_POLYGON) && minAreaPixels>0) {
+			return (bbox.width()/px) * (bbox.height()/px) < minAreaPixels;
+		}
+		if ((geomType==LINESTRING || geomType==CACHED_LINESTRING) && minLengthPixels>0) {
+			return max(bbox.width(), bbox.height()) / px < minLengthPixels;
+		}
+		return false;
+	}
+
 	// Assemble a linestring or polygon into a Boost geometry, and clip to bounding box
 	// Returns a boost::variant -
 	//   POLYGON->MultiPolygon, CENTROID->Point, LINESTRING->MultiLinestring
 	Geometry buildWayGeometry(const OSMStore &osmStore,
 	                      TileBbox *bboxPtr, 
-	                      vector<Geometry> &cachedGeometries) const {
+	                      const vector<Geometry> &cachedGeometries) const {
 
 		ClipGeometryVisitor clip(bboxPtr->clippingBox);
 
@@ -155,6 +205,10 @@ class OutputObject { public:
 			vector_tile::Tile_Value v = valueList->at(i);
 			if (v.has_string_value() && value->has_string_value() && v.string_value()==value->string_value()) { return i; }
 			if (v.has_float_value()  && value->has_float_value()  && v.float_value() ==value->float_value() ) { return i; }
+			if (v.has_double_value() && value->has_double_value() && v.double_value()==value->double_value()) { return i; }
+			if (v.has_int_value()    && value->has_int_value()    && v.int_value()   ==value->int_value()   ) { return i; }
+			if (v.has_uint_value()   && value->has_uint_value()   && v.uint_value()  ==value->uint_value()  ) { return i; }
+			if (v.has_sint_value()   && value->has_sint_value()   && v.sint_value()  ==value->sint_value()  ) { return i; }
 			if (v.has_bool_value()   && value->has_bool_value()   && v.bool_value()  ==value->bool_value()  ) { return i; }
 		}
 		return -1;
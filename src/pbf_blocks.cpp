@@ -31,6 +31,27 @@ void readBlock(google::protobuf::Message *messagePtr, fstream *inputPtr) {
 	messagePtr->ParseFromString(contents);
 }
 
+// Decompressed blocks from a .pbf, by position in the file,
+// kept so the file can be read again quickly (in watch mode)
+struct BlockCache {
+	unordered_map<int64_t, pair<string, int64_t>> blocks;	// position -> (contents, position of next block)
+};
+
+// Read a block as above, from the cache if it's there, keeping it in the cache if not
+void readBlock(google::protobuf::Message *messagePtr, fstream *inputPtr, BlockCache *cache) {
+	if (!cache) { return readBlock(messagePtr, inputPtr); }
+	int64_t position = inputPtr->tellg();
+	auto found = cache->blocks.find(position);
+	if (found != cache->blocks.end()) {
+		messagePtr->ParseFromString(found->second.first);
+		inputPtr->seekg(found->second.second);
+		return;
+	}
+	readBlock(messagePtr, inputPtr);
+	if (inputPtr->eof()) { return; }
+	cache->blocks[position] = make_pair(messagePtr->SerializeAsString(), int64_t(inputPtr->tellg()));
+}
+
 void writeBlock(google::protobuf::Message *messagePtr, fstream *outputPtr, string headerType) {
 	// encode the message
 	string serialised;
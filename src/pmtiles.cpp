@@ -0,0 +1,452 @@
+// Write to (and read from) a PMTiles version 3 archive: a single file that can be served by any
+// static file server or object store, with clients fetching just the byte ranges they need
+//
+// The file is a 127-byte header, then the root directory, JSON metadata, leaf directories and
+// tile data. Each tile is identified by its position along a Hilbert curve at its zoom level,
+// and the tile data is stored in that order, so neighbouring tiles are usually close together.
+// A directory lists (tile ID, offset, length, run length) as varint-encoded columns, gzipped.
+// Identical tiles are stored once, and runs of consecutive identical tiles share one entry.
+//
+// Tiles arrive in any order, so they're written to a temporary file as they come, then copied
+// into Hilbert order when the archive is closed.
+
+// PMTiles tile ID: all tiles at lower zooms, then the tile's Hilbert index at this zoom
+uint64_t zxy2tileid(uint zoom, uint x, uint y) {
+	return ((1ULL << (2*zoom)) - 1) / 3 + hilbertIndex(zoom, x, y);
+}
+
+void tileid2zxy(uint64_t id, uint &zoom, uint &x, uint &y) {
+	uint64_t acc = 0;
+	for (zoom=0; zoom<32; zoom++) {
+		uint64_t count = 1ULL << (2*zoom);
+		if (acc + count > id) { break; }
+		acc += count;
+	}
+	uint64_t t = id - acc, tx = 0, ty = 0;
+	for (uint64_t s=1; s < (1ULL << zoom); s*=2) {
+		uint64_t rx = 1 & (t/2);
+		uint64_t ry = 1 & (t ^ rx);
+		hilbertRotate(s, tx, ty, rx, ry);
+		tx += s * rx;
+		ty += s * ry;
+		t /= 4;
+	}
+	x = tx; y = ty;
+}
+
+struct PMTilesEntry {
+	uint64_t tileId;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t runLength;		// 0 for a pointer to a leaf directory
+};
+
+struct PMTilesHeader {
+	static const uint SIZE = 127;
+	enum Compression { COMPRESSION_UNKNOWN=0, COMPRESSION_NONE=1, COMPRESSION_GZIP=2 };
+	enum TileType { TILETYPE_UNKNOWN=0, TILETYPE_MVT=1 };
+
+	uint64_t rootOffset = 0, rootLength = 0;
+	uint64_t metadataOffset = 0, metadataLength = 0;
+	uint64_t leavesOffset = 0, leavesLength = 0;
+	uint64_t dataOffset = 0, dataLength = 0;
+	uint64_t addressedTiles = 0, tileEntries = 0, tileContents = 0;
+	bool clustered = true;
+	uint8_t internalCompression = COMPRESSION_GZIP;
+	uint8_t tileCompression = COMPRESSION_UNKNOWN;
+	uint8_t tileType = TILETYPE_MVT;
+	uint8_t minZoom = 0, maxZoom = 0, centerZoom = 0;
+	int32_t minLon = 0, minLat = 0, maxLon = 0, maxLat = 0;		// degrees * 10^7
+	int32_t centerLon = 0, centerLat = 0;
+
+	string serialize() const {
+		string out("PMTiles\x03", 8);
+		for (uint64_t v : { rootOffset, rootLength, metadataOffset, metadataLength, leavesOffset, leavesLength,
+		                    dataOffset, dataLength, addressedTiles, tileEntries, tileContents }) { put(out, v, 8); }
+		out.push_back(clustered ? 1 : 0);
+		out.push_back(internalCompression);
+		out.push_back(tileCompression);
+		out.push_back(tileType);
+		out.push_back(minZoom);
+		out.push_back(maxZoom);
+		for (int32_t v : { minLon, minLat, maxLon, maxLat }) { put(out, uint32_t(v), 4); }
+		out.push_back(centerZoom);
+		put(out, uint32_t(centerLon), 4);
+		put(out, uint32_t(centerLat), 4);
+		return out;
+	}
+
+	void parse(const string &in) {
+		if (in.size() < SIZE || in.compare(0, 7, "PMTiles") != 0) { throw runtime_error("Not a PMTiles file"); }
+		if (in[7] != 3) { throw runtime_error("Unsupported PMTiles version " + to_string(int(in[7]))); }
+		uint pos = 8;
+		for (uint64_t *v : { &rootOffset, &rootLength, &metadataOffset, &metadataLength, &leavesOffset, &leavesLength,
+		                     &dataOffset, &dataLength, &addressedTiles, &tileEntries, &tileContents }) { *v = get(in, pos, 8); }
+		clustered           = in[pos++] == 1;
+		internalCompression = in[pos++];
+		tileCompression     = in[pos++];
+		tileType            = in[pos++];
+		minZoom             = in[pos++];
+		maxZoom             = in[pos++];
+		for (int32_t *v : { &minLon, &minLat, &maxLon, &maxLat }) { *v = int32_t(get(in, pos, 4)); }
+		centerZoom          = in[pos++];
+		centerLon           = int32_t(get(in, pos, 4));
+		centerLat           = int32_t(get(in, pos, 4));
+	}
+
+private:
+	static void put(string &out, uint64_t v, uint bytes) {
+		for (uint i=0; i<bytes; i++) { out.push_back(char((v >> (8*i)) & 0xff)); }
+	}
+	static uint64_t get(const string &in, uint &pos, uint bytes) {
+		uint64_t v = 0;
+		for (uint i=0; i<bytes; i++) { v |= uint64_t(uint8_t(in[pos++])) << (8*i); }
+		return v;
+	}
+};
+
+// Varint-encode and gzip a directory
+string serializeDirectory(const vector<PMTilesEntry> &entries) {
+	string out;
+	append_varint(out, entries.size());
+	uint64_t lastId = 0;
+	for (auto &e : entries) { append_varint(out, e.tileId - lastId); lastId = e.tileId; }
+	for (auto &e : entries) { append_varint(out, e.runLength); }
+	for (auto &e : entries) { append_varint(out, e.length); }
+	for (uint i=0; i<entries.size(); i++) {
+		// 0 means "straight after the previous entry", otherwise offset+1
+		if (i>0 && entries[i].offset == entries[i-1].offset + entries[i-1].length) { append_varint(out, 0); }
+		else { append_varint(out, entries[i].offset + 1); }
+	}
+	return compress_string(out, Z_DEFAULT_COMPRESSION, true);
+}
+
+vector<PMTilesEntry> parseDirectory(const string &compressed) {
+	string data = decompress_string(compressed);
+	const char *p = data.data(), *end = p + data.size();
+	vector<PMTilesEntry> entries(read_varint(p, end));
+	uint64_t lastId = 0;
+	for (auto &e : entries) { lastId += read_varint(p, end); e.tileId = lastId; }
+	for (auto &e : entries) { e.runLength = read_varint(p, end); }
+	for (auto &e : entries) { e.length = read_varint(p, end); }
+	for (uint i=0; i<entries.size(); i++) {
+		uint64_t v = read_varint(p, end);
+		if (v==0 && i>0) { entries[i].offset = entries[i-1].offset + entries[i-1].length; }
+		else if (v==0) { throw runtime_error("Bad offset in PMTiles directory"); }
+		else { entries[i].offset = v - 1; }
+	}
+	return entries;
+}
+
+class PMTiles { public:
+
+	static const uint ROOT_SIZE = 16384 - PMTilesHeader::SIZE;	// header and root directory share the first 16k
+	static const uint LEAF_SIZE = 4096;							// initial entries per leaf directory
+
+	uint8_t tileCompression = PMTilesHeader::COMPRESSION_UNKNOWN;
+
+	PMTiles() {
+	}
+
+	~PMTiles() {
+		try { close(); } catch (exception &e) { cerr << "Error writing .pmtiles: " << e.what() << endl; }
+	}
+
+	void open(const string &file) {
+		filename = file;
+		tempFilename = file + ".tmp";
+		tempFile.open(tempFilename, ios::out | ios::trunc | ios::binary);
+		if (!tempFile) { throw runtime_error("Couldn't open " + tempFilename); }
+		isOpen = true;
+	}
+
+	// Add a metadata key with a string value, or with a JSON value
+	void writeMetadata(const string &key, const string &value) {
+		rapidjson::StringBuffer strbuf;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+		writer.String(value.c_str(), value.size());
+		writeMetadataJSON(key, strbuf.GetString());
+	}
+	void writeMetadataJSON(const string &key, const string &json) {
+		metadata.emplace_back(key, json);
+	}
+
+	void saveTile(uint zoom, uint x, uint y, string *data) {
+		string hash = content_hash(*data);
+		auto found = writtenImages.find(hash);
+		uint64_t offset;
+		if (found != writtenImages.end()) {
+			offset = found->second;
+		} else {
+			offset = tempSize;
+			tempFile.write(data->data(), data->size());
+			if (!tempFile) { throw runtime_error("Couldn't write to " + tempFilename); }
+			tempSize += data->size();
+			writtenImages[hash] = offset;
+		}
+		entries.push_back(PMTilesEntry { zxy2tileid(zoom, x, y), offset, uint32_t(data->size()), 1 });
+
+		if (zoom >= extents.size()) { extents.resize(zoom+1); }
+		TileExtent &e = extents[zoom];
+		e.minX = min(e.minX, x); e.maxX = max(e.maxX, x);
+		e.minY = min(e.minY, y); e.maxY = max(e.maxY, y);
+	}
+
+	// Lay out the tiles in Hilbert order and write the archive
+	void close() {
+		if (!isOpen) { return; }
+		isOpen = false;
+		tempFile.close();
+
+		// Sort by tile ID (keeping the last copy of any tile saved twice)
+		stable_sort(entries.begin(), entries.end(), [](const PMTilesEntry &a, const PMTilesEntry &b) { return a.tileId < b.tileId; });
+		vector<PMTilesEntry> sorted;
+		for (auto &e : entries) {
+			if (!sorted.empty() && sorted.back().tileId == e.tileId) { sorted.back() = e; }
+			else { sorted.push_back(e); }
+		}
+		entries.clear(); entries.shrink_to_fit();
+
+		// Give each distinct tile its position in the final data section, in order of first use
+		PMTilesHeader header;
+		unordered_map<uint64_t, uint64_t> finalOffsets;		// offset in temporary file -> offset in archive
+		vector<pair<uint64_t, uint32_t>> copyOrder;			// (offset in temporary file, length)
+		for (auto &e : sorted) {
+			auto found = finalOffsets.find(e.offset);
+			if (found == finalOffsets.end()) {
+				found = finalOffsets.emplace(e.offset, header.dataLength).first;
+				copyOrder.emplace_back(e.offset, e.length);
+				header.dataLength += e.length;
+			}
+			e.offset = found->second;
+		}
+
+		// Collapse runs of identical tiles
+		vector<PMTilesEntry> runs;
+		for (auto &e : sorted) {
+			if (!runs.empty() && runs.back().offset == e.offset && runs.back().tileId + runs.back().runLength == e.tileId) {
+				runs.back().runLength++;
+			} else {
+				runs.push_back(e);
+			}
+		}
+		header.addressedTiles = sorted.size();
+		header.tileEntries = runs.size();
+		header.tileContents = copyOrder.size();
+		sorted.clear(); sorted.shrink_to_fit();
+
+		// Build the directories, splitting into leaves if the root doesn't fit
+		string root = serializeDirectory(runs), leaves;
+		for (uint leafSize = LEAF_SIZE; root.size() > ROOT_SIZE; leafSize *= 2) {
+			vector<PMTilesEntry> rootEntries;
+			leaves.clear();
+			for (uint i=0; i<runs.size(); i+=leafSize) {
+				vector<PMTilesEntry> leaf(runs.begin()+i, runs.begin()+min<size_t>(i+leafSize, runs.size()));
+				string serialized = serializeDirectory(leaf);
+				rootEntries.push_back(PMTilesEntry { leaf.front().tileId, leaves.size(), uint32_t(serialized.size()), 0 });
+				leaves += serialized;
+			}
+			root = serializeDirectory(rootEntries);
+		}
+
+		// Metadata
+		string json = "{";
+		for (auto &m : metadata) {
+			if (json.size()>1) { json += ","; }
+			rapidjson::StringBuffer strbuf;
+			rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+			writer.String(m.first.c_str(), m.first.size());
+			json += strbuf.GetString();
+			json += ":" + m.second;
+		}
+		json += "}";
+		string compressedMetadata = compress_string(json, Z_DEFAULT_COMPRESSION, true);
+
+		// Header
+		header.rootOffset = PMTilesHeader::SIZE;
+		header.rootLength = root.size();
+		header.metadataOffset = header.rootOffset + header.rootLength;
+		header.metadataLength = compressedMetadata.size();
+		header.leavesOffset = header.metadataOffset + header.metadataLength;
+		header.leavesLength = leaves.size();
+		header.dataOffset = header.leavesOffset + header.leavesLength;
+		header.tileCompression = tileCompression;
+		setBounds(header);
+
+		// Write everything out, copying the tile data across in order
+		ofstream out(filename, ios::out | ios::trunc | ios::binary);
+		out << header.serialize() << root << compressedMetadata << leaves;
+		ifstream in(tempFilename, ios::in | ios::binary);
+		string buffer;
+		for (auto &c : copyOrder) {
+			buffer.resize(c.second);
+			in.seekg(c.first);
+			in.read(&buffer[0], c.second);
+			out.write(buffer.data(), c.second);
+		}
+		in.close();
+		out.close();
+		if (!in || !out) { throw runtime_error("Couldn't write to " + filename); }
+		boost::filesystem::remove(tempFilename);
+	}
+
+private:
+	struct TileExtent {
+		uint minX = UINT_MAX, minY = UINT_MAX, maxX = 0, maxY = 0;
+	};
+
+	string filename, tempFilename;
+	ofstream tempFile;
+	uint64_t tempSize = 0;
+	bool isOpen = false;
+	vector<PMTilesEntry> entries;					// offsets are into the temporary file until close()
+	unordered_map<string, uint64_t> writtenImages;	// content hash -> offset in temporary file
+	vector<pair<string, string>> metadata;			// key -> JSON value
+	vector<TileExtent> extents;						// range of tiles written at each zoom level
+
+	// Zoom range and bounds from the tiles written
+	void setBounds(PMTilesHeader &header) {
+		header.minZoom = 255;
+		for (uint z=0; z<extents.size(); z++) {
+			if (extents[z].minX == UINT_MAX) { continue; }
+			header.minZoom = min<uint>(header.minZoom, z);
+			header.maxZoom = z;
+		}
+		if (header.minZoom == 255) { header.minZoom = 0; return; }
+		const TileExtent &e = extents[header.maxZoom];
+		double minLon = tilex2lon(e.minX, header.maxZoom), maxLon = tilex2lon(e.maxX+1, header.maxZoom);
+		double minLat = tiley2lat(e.maxY+1, header.maxZoom), maxLat = tiley2lat(e.minY, header.maxZoom);
+		header.minLon = lround(minLon * 10000000); header.maxLon = lround(maxLon * 10000000);
+		header.minLat = lround(minLat * 10000000); header.maxLat = lround(maxLat * 10000000);
+		header.centerZoom = header.minZoom;
+		header.centerLon = lround((minLon+maxLon) / 2 * 10000000);
+		header.centerLat = lround((minLat+maxLat) / 2 * 10000000);
+	}
+};
+
+// Read tiles from a PMTiles archive, fetching only the byte ranges needed (as a client would)
+
+class PMTilesReader { public:
+
+	PMTilesHeader header;
+
+	void open(const string &file) {
+		filename = file;
+		in.open(filename, ios::in | ios::binary);
+		if (!in) { throw runtime_error("Couldn't open " + filename); }
+		in.seekg(0, ios::end);
+		fileSize = in.tellg();
+		header.parse(readRange(0, PMTilesHeader::SIZE));
+	}
+
+	// Find a tile; returns false if it's not in the archive
+	bool getTile(uint zoom, uint x, uint y, string &data) {
+		uint64_t tileId = zxy2tileid(zoom, x, y);
+		uint64_t dirOffset = header.rootOffset, dirLength = header.rootLength;
+		for (uint depth=0; depth<4; depth++) {
+			vector<PMTilesEntry> entries = parseDirectory(readRange(dirOffset, dirLength));
+			// last entry starting at or before this tile
+			auto it = upper_bound(entries.begin(), entries.end(), tileId, [](uint64_t id, const PMTilesEntry &e) { return id < e.tileId; });
+			if (it == entries.begin()) { return false; }
+			--it;
+			if (it->runLength == 0) {
+				dirOffset = header.leavesOffset + it->offset;
+				dirLength = it->length;
+				continue;
+			}
+			if (tileId >= it->tileId + it->runLength) { return false; }
+			data = readRange(header.dataOffset + it->offset, it->length);
+			return true;
+		}
+		return false;
+	}
+
+	// Check the archive's structure and that every tile can be decoded; problems are reported to cerr
+	bool validate(bool verbose) {
+		bool ok = true;
+		auto fail = [&](const string &msg) { cerr << filename << ": " << msg << endl; ok = false; };
+
+		if (header.rootOffset != PMTilesHeader::SIZE) { fail("root directory doesn't follow the header"); }
+		if (header.rootOffset + header.rootLength > 16384) { fail("root directory extends beyond the first 16k"); }
+		for (auto section : { make_pair(header.rootOffset, header.rootLength), make_pair(header.metadataOffset, header.metadataLength),
+		                      make_pair(header.leavesOffset, header.leavesLength), make_pair(header.dataOffset, header.dataLength) }) {
+			if (section.first + section.second > fileSize) { fail("section at " + to_string(section.first) + " extends beyond the end of the file"); }
+		}
+		if (!ok) { return false; }
+
+		try {
+			string json = decompress_string(readRange(header.metadataOffset, header.metadataLength));
+			rapidjson::Document metadata;
+			metadata.Parse(json.c_str());
+			if (metadata.HasParseError() || !metadata.IsObject()) { fail("metadata isn't a JSON object"); }
+		} catch (exception &e) { fail(string("couldn't read metadata: ") + e.what()); }
+
+		// Walk the directories in order, collecting every tile entry
+		vector<PMTilesEntry> tiles;
+		try {
+			walkDirectory(header.rootOffset, header.rootLength, 0, tiles, fail);
+		} catch (exception &e) { fail(string("couldn't read directories: ") + e.what()); return false; }
+
+		uint64_t addressed = 0, nextOffset = 0;
+		uint minZoom = 255, maxZoom = 0;
+		unordered_set<uint64_t> contents;
+		for (uint i=0; i<tiles.size(); i++) {
+			const PMTilesEntry &e = tiles[i];
+			if (e.runLength == 0) { fail("leaf directory entry at tile " + to_string(e.tileId) + " points to another leaf"); continue; }
+			if (i>0 && e.tileId < tiles[i-1].tileId + tiles[i-1].runLength) { fail("tile " + to_string(e.tileId) + " is out of order or overlaps the previous entry"); }
+			if (e.offset + e.length > header.dataLength) { fail("tile " + to_string(e.tileId) + " extends beyond the tile data"); continue; }
+			addressed += e.runLength;
+			uint z, x, y;
+			tileid2zxy(e.tileId, z, x, y); minZoom = min(minZoom, z);
+			tileid2zxy(e.tileId + e.runLength - 1, z, x, y); maxZoom = max(maxZoom, z);
+			if (!contents.insert(e.offset).second) { continue; }
+			if (header.clustered && e.offset != nextOffset) { fail("tile " + to_string(e.tileId) + " isn't stored in tile ID order"); }
+			nextOffset = e.offset + e.length;
+
+			string data = readRange(header.dataOffset + e.offset, e.length);
+			try {
+				if (header.tileCompression == PMTilesHeader::COMPRESSION_GZIP) { data = decompress_string(data); }
+				vector_tile::Tile tile;
+				if (header.tileType == PMTilesHeader::TILETYPE_MVT &&
+				    header.tileCompression != PMTilesHeader::COMPRESSION_UNKNOWN && !tile.ParseFromString(data)) {
+					fail("tile " + to_string(e.tileId) + " isn't a valid vector tile");
+				}
+			} catch (exception &ex) { fail("tile " + to_string(e.tileId) + " couldn't be decompressed: " + ex.what()); }
+		}
+		if (addressed != header.addressedTiles) { fail("header says " + to_string(header.addressedTiles) + " addressed tiles, found " + to_string(addressed)); }
+		if (tiles.size() != header.tileEntries) { fail("header says " + to_string(header.tileEntries) + " tile entries, found " + to_string(tiles.size())); }
+		if (contents.size() != header.tileContents) { fail("header says " + to_string(header.tileContents) + " tile contents, found " + to_string(contents.size())); }
+		if (!tiles.empty() && (minZoom != header.minZoom || maxZoom != header.maxZoom)) { fail("zoom range doesn't match the header"); }
+
+		if (verbose || ok) {
+			cout << filename << ": " << addressed << " tiles (" << contents.size() << " distinct) in " << tiles.size()
+			     << " entries, zoom " << minZoom << "-" << maxZoom << (ok ? ", valid" : "") << endl;
+		}
+		return ok;
+	}
+
+private:
+	string filename;
+	ifstream in;
+	uint64_t fileSize = 0;
+
+	string readRange(uint64_t offset, uint64_t length) {
+		if (offset + length > fileSize) { throw runtime_error("Read beyond end of " + filename); }
+		string data(length, 0);
+		in.seekg(offset);
+		in.read(&data[0], length);
+		if (!in) { throw runtime_error("Couldn't read " + filename); }
+		return data;
+	}
+
+	template <typename F>
+	void walkDirectory(uint64_t offset, uint64_t length, uint depth, vector<PMTilesEntry> &tiles, F &fail) {
+		if (depth > 3) { fail("directories nested too deeply"); return; }
+		for (auto &e : parseDirectory(readRange(offset, length))) {
+			if (e.runLength > 0) { tiles.push_back(e); continue; }
+			if (depth > 0) { tiles.push_back(e); continue; }	// (reported as an error by the caller)
+			if (e.offset + e.length > header.leavesLength) { fail("leaf directory at tile " + to_string(e.tileId) + " extends beyond the leaf section"); continue; }
+			walkDirectory(header.leavesOffset + e.offset, e.length, depth+1, tiles, fail);
+		}
+	}
+};
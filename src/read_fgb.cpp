@@ -0,0 +1,404 @@
+/*
+	Read FlatGeobuf files into Boost geometries
+
+	A FlatGeobuf file is a header, an optional packed Hilbert R-tree of the features' envelopes,
+	then the features, each a FlatBuffer. Only the index nodes that intersect the clipping box
+	are read, then only the features they point to, so a small area can be taken from a large
+	file quickly and without loading it all. (Files without an index are read in full.)
+
+	The FlatBuffers are read directly, with just enough of the format for FlatGeobuf's schema,
+	rather than adding a dependency on the FlatBuffers library. Like shapefiles, files must be
+	in WGS84 (EPSG:4326).
+
+	Format: https://github.com/flatgeobuf/flatgeobuf
+*/
+
+// ----	FlatBuffer tables
+//		A table starts with an offset back to its vtable, which gives the position of each field
+//		within the table (or 0 if absent). Strings, vectors and sub-tables are stored as offsets
+//		from the field's position.
+
+class FlatTable { public:
+
+	FlatTable(const string &buffer, size_t pos) : buffer(&buffer), pos(pos) {
+		vtable = pos - get<int32_t>(pos);
+		vtableSize = get<uint16_t>(vtable);
+	}
+
+	// The root table of a buffer
+	static FlatTable root(const string &buffer) {
+		FlatTable t(buffer);
+		return FlatTable(buffer, t.get<uint32_t>(0));
+	}
+
+	bool has(uint field) const { return fieldOffset(field) != 0; }
+
+	template <typename T>
+	T scalar(uint field, T def) const {
+		uint16_t offset = fieldOffset(field);
+		return offset ? get<T>(pos + offset) : def;
+	}
+
+	string str(uint field) const {
+		size_t at = target(field);
+		if (!at) { return ""; }
+		uint32_t length = get<uint32_t>(at);
+		check(at + 4, length);
+		return buffer->substr(at + 4, length);
+	}
+
+	// A vector of scalars (or bytes)
+	template <typename T>
+	vector<T> vec(uint field) const {
+		size_t at = target(field);
+		if (!at) { return vector<T>(); }
+		vector<T> v(get<uint32_t>(at));
+		check(at + 4, v.size() * sizeof(T));
+		memcpy(v.data(), buffer->data() + at + 4, v.size() * sizeof(T));
+		return v;
+	}
+
+	// A vector of tables
+	vector<FlatTable> tables(uint field) const {
+		vector<FlatTable> v;
+		size_t at = target(field);
+		if (!at) { return v; }
+		uint32_t length = get<uint32_t>(at);
+		for (uint32_t i=0; i<length; i++) {
+			size_t element = at + 4 + i*4;
+			v.emplace_back(*buffer, element + get<uint32_t>(element));
+		}
+		return v;
+	}
+
+	FlatTable table(uint field) const {
+		size_t at = target(field);
+		if (!at) { throw runtime_error("Missing table in FlatGeobuf data"); }
+		return FlatTable(*buffer, at);
+	}
+
+	template <typename T>
+	T get(size_t at) const {
+		check(at, sizeof(T));
+		T value;
+		memcpy(&value, buffer->data() + at, sizeof(T));
+		return value;
+	}
+
+private:
+	const string *buffer;
+	size_t pos = 0, vtable = 0;
+	uint16_t vtableSize = 0;
+
+	FlatTable(const string &buffer) : buffer(&buffer) { }
+
+	void check(size_t at, size_t length) const {
+		if (at > buffer->size() || length > buffer->size() - at) { throw runtime_error("Corrupt FlatGeobuf data"); }
+	}
+
+	uint16_t fieldOffset(uint field) const {
+		size_t at = 4 + 2*field;
+		return at < vtableSize ? get<uint16_t>(vtable + at) : 0;
+	}
+
+	// Position of the string, vector or table that a field points to (0 if absent)
+	size_t target(uint field) const {
+		uint16_t offset = fieldOffset(field);
+		return offset ? pos + offset + get<uint32_t>(pos + offset) : 0;
+	}
+};
+
+// ----	FlatGeobuf reader
+
+class FlatGeobufReader { public:
+
+	// Field numbers and enums from the FlatGeobuf schema (header.fbs and feature.fbs)
+	enum HeaderField { HEADER_GEOMETRY_TYPE = 2, HEADER_COLUMNS = 7, HEADER_FEATURES_COUNT = 8, HEADER_INDEX_NODE_SIZE = 9 };
+	enum ColumnField { COLUMN_NAME = 0, COLUMN_TYPE = 1 };
+	enum FeatureField { FEATURE_GEOMETRY = 0, FEATURE_PROPERTIES = 1 };
+	enum GeometryField { GEOMETRY_ENDS = 0, GEOMETRY_XY = 1, GEOMETRY_TYPE = 6, GEOMETRY_PARTS = 7 };
+	enum GeometryType { UNKNOWN = 0, POINT_TYPE = 1, LINESTRING_TYPE = 2, POLYGON_TYPE = 3,
+	                    MULTIPOINT_TYPE = 4, MULTILINESTRING_TYPE = 5, MULTIPOLYGON_TYPE = 6 };
+	enum ColumnType { BYTE, UBYTE, BOOL, SHORT, USHORT, INT, UINT, LONG, ULONG, FLOAT, DOUBLE, STRING, JSON, DATETIME, BINARY };
+
+	struct Column {
+		string name;
+		uint8_t type;
+	};
+
+	uint8_t geometryType = UNKNOWN;
+	vector<Column> columns;
+	uint64_t featuresCount = 0;
+	uint16_t indexNodeSize = 0;
+
+	void open(const string &filename) {
+		in.open(filename, ios::in | ios::binary);
+		if (!in) { throw runtime_error("Couldn't open " + filename); }
+		char magic[8];
+		in.read(magic, 8);
+		if (!in || memcmp(magic, "fgb", 3) != 0 || magic[3] != 3) { throw runtime_error(filename + " isn't a FlatGeobuf (version 3) file"); }
+
+		headerBuffer = readSizePrefixed();
+		FlatTable header = FlatTable::root(headerBuffer);
+		geometryType  = header.scalar<uint8_t>(HEADER_GEOMETRY_TYPE, UNKNOWN);
+		featuresCount = header.scalar<uint64_t>(HEADER_FEATURES_COUNT, 0);
+		indexNodeSize = header.scalar<uint16_t>(HEADER_INDEX_NODE_SIZE, 16);
+		for (auto &column : header.tables(HEADER_COLUMNS)) {
+			columns.push_back(Column { column.str(COLUMN_NAME), column.scalar<uint8_t>(COLUMN_TYPE, STRING) });
+		}
+
+		indexOffset = in.tellg();
+		if (indexNodeSize == 1) { throw runtime_error(filename + " has an invalid index node size"); }
+		featuresOffset = indexOffset + (hasIndex() ? levelBounds().front().second * NODE_SIZE : 0);
+	}
+
+	bool hasIndex() const { return indexNodeSize > 0 && featuresCount > 0; }
+
+	// Call f(feature) for each feature whose envelope intersects the box (in degrees)
+	// (or for every feature, if there's no index)
+	template <typename F>
+	void forEachFeature(double minX, double minY, double maxX, double maxY, F f) {
+		if (!hasIndex()) {
+			in.seekg(featuresOffset);
+			while (in.peek() != char_traits<char>::eof()) { readFeature(f); }
+			return;
+		}
+		for (uint64_t offset : search(minX, minY, maxX, maxY)) {
+			in.seekg(featuresOffset + offset);
+			readFeature(f);
+		}
+	}
+
+	// Read a feature's properties (those in wanted) as vector tile values
+	void readProperties(const FlatTable &feature, const unordered_set<string> &wanted, map<string, vector_tile::Tile_Value> &properties) const {
+		vector<uint8_t> data = feature.vec<uint8_t>(FEATURE_PROPERTIES);
+		size_t pos = 0;
+		auto take = [&](size_t length) -> const uint8_t * {
+			if (length > data.size() - pos) { throw runtime_error("Corrupt FlatGeobuf properties"); }
+			pos += length;
+			return data.data() + pos - length;
+		};
+		while (pos < data.size()) {
+			uint16_t columnNum; memcpy(&columnNum, take(2), 2);
+			if (columnNum >= columns.size()) { throw runtime_error("Corrupt FlatGeobuf properties"); }
+			const Column &column = columns[columnNum];
+			vector_tile::Tile_Value v;
+			switch (column.type) {
+				case BYTE:   { int8_t   x; memcpy(&x, take(1), 1); setIntegerValue(v, x); break; }
+				case UBYTE:  { uint8_t  x; memcpy(&x, take(1), 1); setIntegerValue(v, x); break; }
+				case BOOL:   { uint8_t  x; memcpy(&x, take(1), 1); v.set_bool_value(x != 0); break; }
+				case SHORT:  { int16_t  x; memcpy(&x, take(2), 2); setIntegerValue(v, x); break; }
+				case USHORT: { uint16_t x; memcpy(&x, take(2), 2); setIntegerValue(v, x); break; }
+				case INT:    { int32_t  x; memcpy(&x, take(4), 4); setIntegerValue(v, x); break; }
+				case UINT:   { uint32_t x; memcpy(&x, take(4), 4); setIntegerValue(v, x); break; }
+				case LONG:   { int64_t  x; memcpy(&x, take(8), 8); setIntegerValue(v, x); break; }
+				case ULONG:  { uint64_t x; memcpy(&x, take(8), 8); v.set_uint_value(x); break; }
+				case FLOAT:  { float    x; memcpy(&x, take(4), 4); v.set_float_value(x); break; }
+				case DOUBLE: { double   x; memcpy(&x, take(8), 8); v.set_double_value(x); break; }
+				case STRING: case JSON: case DATETIME: case BINARY: {
+					uint32_t length; memcpy(&length, take(4), 4);
+					const uint8_t *bytes = take(length);
+					if (column.type == BINARY) { continue; }
+					v.set_string_value(string(reinterpret_cast<const char *>(bytes), length));
+					break;
+				}
+				default: throw runtime_error("Unknown FlatGeobuf column type");
+			}
+			if (wanted.count(column.name)) { properties[column.name] = v; }
+		}
+	}
+
+private:
+	static const uint NODE_SIZE = 40;		// minX, minY, maxX, maxY (doubles), offset (uint64)
+
+	ifstream in;
+	string headerBuffer, featureBuffer;
+	uint64_t indexOffset = 0, featuresOffset = 0;
+
+	// Read a uint32 length, then that many bytes
+	string readSizePrefixed() {
+		uint32_t length = read_raw<uint32_t>(in);
+		string buffer(length, 0);
+		in.read(&buffer[0], length);
+		if (!in) { throw runtime_error("Unexpected end of FlatGeobuf file"); }
+		return buffer;
+	}
+
+	template <typename F>
+	void readFeature(F f) {
+		featureBuffer = readSizePrefixed();
+		f(FlatTable::root(featureBuffer));
+	}
+
+	// Start and end node of each level of the R-tree, from the leaves up
+	// (the tree is stored root first, so the leaves are at the end, and the end of the leaves
+	// is the number of nodes)
+	vector<pair<uint64_t, uint64_t>> levelBounds() const {
+		vector<uint64_t> levelNodes;
+		uint64_t n = featuresCount, numNodes = n;
+		levelNodes.push_back(n);
+		do {
+			n = (n + indexNodeSize - 1) / indexNodeSize;
+			numNodes += n;
+			levelNodes.push_back(n);
+		} while (n != 1);
+		vector<pair<uint64_t, uint64_t>> bounds;
+		for (uint64_t nodes : levelNodes) {
+			numNodes -= nodes;
+			bounds.emplace_back(numNodes, numNodes + nodes);
+		}
+		return bounds;
+	}
+
+	// Walk the R-tree from the root, reading only nodes whose parents intersect the box, and
+	// return the offsets of the matching features (in file order, so they're read sequentially)
+	vector<uint64_t> search(double minX, double minY, double maxX, double maxY) {
+		vector<pair<uint64_t, uint64_t>> bounds = levelBounds();
+		uint64_t leavesStart = bounds.front().first;
+		vector<uint64_t> offsets;
+		deque<pair<uint64_t, uint>> queue;		// (first node, level)
+		queue.emplace_back(0, bounds.size()-1);
+		vector<char> nodes(indexNodeSize * NODE_SIZE);
+		while (!queue.empty()) {
+			uint64_t first = queue.front().first;
+			uint level = queue.front().second;
+			queue.pop_front();
+			uint64_t last = min<uint64_t>(first + indexNodeSize, bounds[level].second);
+			if (first >= last) { continue; }
+			in.seekg(indexOffset + first * NODE_SIZE);
+			in.read(nodes.data(), (last - first) * NODE_SIZE);
+			if (!in) { throw runtime_error("Unexpected end of FlatGeobuf index"); }
+			for (uint64_t i=0; i<last-first; i++) {
+				double box[4]; uint64_t offset;
+				memcpy(box, &nodes[i*NODE_SIZE], sizeof(box));
+				memcpy(&offset, &nodes[i*NODE_SIZE + 32], sizeof(offset));
+				if (box[2] < minX || box[0] > maxX || box[3] < minY || box[1] > maxY) { continue; }
+				if (first + i >= leavesStart) { offsets.push_back(offset); }
+				else { queue.emplace_back(offset, level-1); }
+			}
+		}
+		sort(offsets.begin(), offsets.end());
+		return offsets;
+	}
+};
+
+// ----	Converting FlatGeobuf geometries
+
+// Points from a flat x,y array, projected to latp
+void fgbPoints(const vector<double> &xy, size_t start, size_t end, vector<Point> &points) {
+	points.clear();
+	for (size_t i=start; i<end && i*2+1<xy.size(); i++) {
+		points.emplace_back(xy[i*2], lat2latp(fmin(fmax(xy[i*2+1], MinLat), MaxLat)));
+	}
+}
+
+// Start and end point of each part (ring or linestring), from the 'ends' array
+vector<pair<size_t, size_t>> fgbParts(const FlatTable &geometry, size_t numPoints) {
+	vector<uint32_t> ends = geometry.vec<uint32_t>(FlatGeobufReader::GEOMETRY_ENDS);
+	if (ends.empty()) { ends.push_back(numPoints); }
+	vector<pair<size_t, size_t>> parts;
+	size_t start = 0;
+	for (uint32_t end : ends) { parts.emplace_back(start, end); start = end; }
+	return parts;
+}
+
+// A polygon: the first ring is the exterior, the rest interiors
+Polygon fgbPolygon(const FlatTable &geometry) {
+	vector<double> xy = geometry.vec<double>(FlatGeobufReader::GEOMETRY_XY);
+	Polygon poly;
+	vector<Point> points;
+	uint ringNum = 0;
+	for (auto &part : fgbParts(geometry, xy.size()/2)) {
+		fgbPoints(xy, part.first, part.second, points);
+		if (ringNum++ == 0) {
+			geom::append(poly.outer(), points);
+		} else {
+			poly.inners().emplace_back();
+			geom::append(poly.inners().back(), points);
+		}
+	}
+	return poly;
+}
+
+void addFlatGeobufGeometry(LayerBuilder &builder, const FlatTable &geometry, uint8_t type,
+                           const map<string, vector_tile::Tile_Value> &attributes, const string *name) {
+	typedef FlatGeobufReader R;
+	if (type == R::UNKNOWN) { type = geometry.scalar<uint8_t>(R::GEOMETRY_TYPE, R::UNKNOWN); }
+	vector<Point> points;
+
+	if (type == R::POINT_TYPE || type == R::MULTIPOINT_TYPE) {
+		vector<double> xy = geometry.vec<double>(R::GEOMETRY_XY);
+		fgbPoints(xy, 0, xy.size()/2, points);
+		for (auto &p : points) { builder.addPoint(p, attributes, name); }
+
+	} else if (type == R::LINESTRING_TYPE || type == R::MULTILINESTRING_TYPE) {
+		vector<double> xy = geometry.vec<double>(R::GEOMETRY_XY);
+		for (auto &part : fgbParts(geometry, xy.size()/2)) {
+			Linestring ls;
+			fgbPoints(xy, part.first, part.second, points);
+			geom::assign_points(ls, points);
+			builder.addLinestring(ls, attributes, name);
+		}
+
+	} else if (type == R::POLYGON_TYPE || type == R::MULTIPOLYGON_TYPE) {
+		MultiPolygon multi;
+		if (type == R::POLYGON_TYPE) {
+			multi.push_back(fgbPolygon(geometry));
+		} else {
+			for (auto &part : geometry.tables(R::GEOMETRY_PARTS)) { multi.push_back(fgbPolygon(part)); }
+		}
+		// (ring orientation isn't fixed by the format)
+		geom::correct(multi);
+		builder.addPolygon(multi, attributes, name);
+
+	} else {
+		cerr << "FlatGeobuf geometry type " << int(type) << " not supported" << endl;
+	}
+}
+
+// A property as text, for FindIntersecting
+string valueToString(const vector_tile::Tile_Value &v) {
+	ostringstream out;
+	if      (v.has_string_value()) { return v.string_value(); }
+	else if (v.has_double_value()) { out << v.double_value(); }
+	else if (v.has_float_value())  { out << v.float_value(); }
+	else if (v.has_int_value())    { out << v.int_value(); }
+	else if (v.has_uint_value())   { out << v.uint_value(); }
+	else if (v.has_sint_value())   { out << v.sint_value(); }
+	else if (v.has_bool_value())   { out << (v.bool_value() ? "true" : "false"); }
+	return out.str();
+}
+
+// Read a FlatGeobuf file, and create OutputObjects for all features within the specified bounding box
+// (arguments are taken by value, as this runs on its own thread)
+ShapefileLayer readFlatGeobuf(string filename,
+                              vector<string> columns,
+                              Box clippingBox,
+                              uint baseZoom, uint layerNum,
+                              bool isIndexed, string indexName) {
+
+	LayerBuilder builder(clippingBox, baseZoom, layerNum, isIndexed);
+	FlatGeobufReader reader;
+	reader.open(filename);
+
+	unordered_set<string> wanted(columns.begin(), columns.end());
+	if (isIndexed && !indexName.empty()) { wanted.insert(indexName); }
+	double minLat = latp2lat(clippingBox.min_corner().get<1>()), maxLat = latp2lat(clippingBox.max_corner().get<1>());
+
+	reader.forEachFeature(clippingBox.min_corner().get<0>(), minLat, clippingBox.max_corner().get<0>(), maxLat, [&](const FlatTable &feature) {
+		if (!feature.has(FlatGeobufReader::FEATURE_GEOMETRY)) { return; }
+		map<string, vector_tile::Tile_Value> properties;
+		reader.readProperties(feature, wanted, properties);
+
+		// the index column is only written to the tiles if it's also in source_columns
+		string name;
+		const string *namePtr = nullptr;
+		if (isIndexed && !indexName.empty()) {
+			auto found = properties.find(indexName);
+			if (found != properties.end()) { name = valueToString(found->second); namePtr = &name; }
+			if (!count(columns.begin(), columns.end(), indexName)) { properties.erase(indexName); }
+		}
+		addFlatGeobufGeometry(builder, feature.table(FlatGeobufReader::FEATURE_GEOMETRY), reader.geometryType, properties, namePtr);
+	});
+	return move(builder.layer);
+}
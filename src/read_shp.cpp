@@ -1,7 +1,28 @@
 /*
 	Read shapefiles into Boost geometries
+
+	Each shapefile layer is read on its own thread, into a ShapefileLayer whose geometry IDs
+	start from 0. Once it's finished, it's merged into the global stores, with the IDs offset.
+	Layers that Lua can query (those with "index") are merged before the .pbf is read; the rest
+	are merged afterwards, so reading them overlaps with reading the .pbf.
 */
 
+// One shapefile layer, read but not yet merged
+struct ShapefileLayer {
+	vector<Geometry> geometries;
+	map<uint, string> names;						// optional names for each geometry
+	map< TileKey, vector<OutputObject> > tileIndex;
+	vector<IndexValue> indexEntries;				// envelopes for the spatial index (if indexed)
+};
+
+// A layer being read in the background
+struct PendingShapefile {
+	string layerName;
+	bool indexed;
+	uint indexCapacity;							// max entries in each node of the spatial index
+	future<ShapefileLayer> result;
+};
+
 void fillPointArrayFromShapefile(vector<Point> *points, SHPObject *shape, uint part) {
 	int start = shape->panPartStart[part];
 	int end   = (part==shape->nParts-1) ? shape->nVertices : shape->panPartStart[part+1];
@@ -25,7 +46,7 @@ void fillPointArrayFromShapefile(vector<Point> *points, SHPObject *shape, uint p
 }
 
 // Add an OutputObject to all tiles between min/max lat/lon
-void addToTileIndexByBbox(OutputObject &oo, map< uint, vector<OutputObject> > &tileIndex, uint baseZoom,
+void addToTileIndexByBbox(OutputObject &oo, map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom,
                           double minLon, double minLatp, double maxLon, double maxLatp) {
 	uint minTileX =  lon2tilex(minLon, baseZoom);
 	uint maxTileX =  lon2tilex(maxLon, baseZoom);
@@ -33,25 +54,24 @@ void addToTileIndexByBbox(OutputObject &oo, map< uint, vector<OutputObject> > &t
 	uint maxTileY = latp2tiley(maxLatp, baseZoom);
 	for (uint x=min(minTileX,maxTileX); x<=max(minTileX,maxTileX); x++) {
 		for (uint y=min(minTileY,maxTileY); y<=max(minTileY,maxTileY); y++) {
-			uint32_t index = x*65536+y;
-			tileIndex[index].push_back(oo);
+			tileIndex[tileKey(x,y)].push_back(oo);
 		}
 	}
 }
 
 // Add an OutputObject to all tiles along a polyline
-void addToTileIndexPolyline(OutputObject &oo, map< uint, vector<OutputObject> > &tileIndex, uint baseZoom, const Linestring &ls) {
+void addToTileIndexPolyline(OutputObject &oo, map< TileKey, vector<OutputObject> > &tileIndex, uint baseZoom, const Linestring &ls) {
 	uint lastx = UINT_MAX;
 	uint lasty;
 	for (Linestring::const_iterator jt = ls.begin(); jt != ls.end(); ++jt) {
 		uint tilex =  lon2tilex(jt->get<0>(), baseZoom);
 		uint tiley = latp2tiley(jt->get<1>(), baseZoom);
 		if (lastx==UINT_MAX) {
-			tileIndex[tilex*65536+tiley].push_back(oo);
+			tileIndex[tileKey(tilex,tiley)].push_back(oo);
 		} else if (lastx!=tilex || lasty!=tiley) {
 			for (int x=min(tilex,lastx); x<=max(tilex,lastx); x++) {
 				for (int y=min(tiley,lasty); y<=max(tiley,lasty); y++) {
-					tileIndex[x*65536+y].push_back(oo);
+					tileIndex[tileKey(x,y)].push_back(oo);
 				}
 			}
 		}
@@ -59,37 +79,194 @@ void addToTileIndexPolyline(OutputObject &oo, map< uint, vector<OutputObject> >
 	}
 }
 
-// Read requested attributes from a shapefile, and encode into an OutputObject
-void addShapefileAttributes(DBFHandle &dbf, OutputObject &oo, int recordNum, unordered_map<int,string> &columnMap, unordered_map<int,int> &columnTypeMap) {
+// ----	Splitting large polygons
+//		Writing a tile clips every polygon in it to the tile, so a huge polygon (a continent's
+//		water, say) would be clipped in full for each of the thousands of tiles it covers.
+//		Instead, polygons with many points are split into tile-aligned pieces when they're read,
+//		and each piece goes only in the tiles it covers. Pieces overlap by the same margin as
+//		tiles' clipping boxes, and pieces with the same attributes are merged again when written.
+//		(Layers with "index" aren't split, as Lua queries need the whole polygon.)
+
+const uint SPLIT_POLYGON_POINTS = 256;	// split polygons with more points than this
+
+// A tile's box, with the margin that TileBbox clips to
+Box splitBox(uint zoom, uint x, uint y) {
+	double minLon = tilex2lon(x, zoom), maxLon = tilex2lon(x+1, zoom);
+	double margin = (maxLon-minLon)/200.0;
+	return Box(geom::make<Point>(minLon-margin, tiley2latp(y+1, zoom)-margin),
+	           geom::make<Point>(maxLon+margin, tiley2latp(y  , zoom)+margin));
+}
+
+// Quarter a polygon (already within tile zoom/x/y) until the pieces are small enough,
+// or down to the base zoom
+void splitPolygon(const MultiPolygon &mp, uint zoom, uint x, uint y, uint baseZoom, vector<MultiPolygon> &pieces) {
+	if (zoom>=baseZoom || geom::num_points(mp)<=SPLIT_POLYGON_POINTS) { pieces.push_back(mp); return; }
+	for (uint i=0; i<4; i++) {
+		uint cx = x*2 + (i & 1), cy = y*2 + (i >> 1);
+		MultiPolygon piece;
+		geom::intersection(mp, splitBox(zoom+1, cx, cy), piece);
+		if (!piece.empty()) { splitPolygon(piece, zoom+1, cx, cy, baseZoom, pieces); }
+	}
+}
+
+vector<MultiPolygon> splitPolygon(const MultiPolygon &mp, const Box &box, uint baseZoom) {
+	// start from the smallest tile that contains the whole polygon
+	uint zoom = 0;
+	while (zoom<baseZoom &&
+	       lon2tilex(box.min_corner().get<0>(), zoom+1) == lon2tilex(box.max_corner().get<0>(), zoom+1) &&
+	       latp2tiley(box.min_corner().get<1>(), zoom+1) == latp2tiley(box.max_corner().get<1>(), zoom+1)) { zoom++; }
+	vector<MultiPolygon> pieces;
+	splitPolygon(mp, zoom, lon2tilex(box.min_corner().get<0>(), zoom), latp2tiley(box.max_corner().get<1>(), zoom), baseZoom, pieces);
+	return pieces;
+}
+
+// ----	Adding features to a layer
+//		Used by both the shapefile and FlatGeobuf readers, once they've turned a feature into
+//		Boost geometries (in latp). Each is clipped to the bounding box, then added to the
+//		tile index and, for indexed layers, the spatial index with its name (if any).
+
+class LayerBuilder { public:
+	ShapefileLayer layer;
+
+	LayerBuilder(const Box &clippingBox, uint baseZoom, uint layerNum, bool isIndexed) :
+		clippingBox(clippingBox), baseZoom(baseZoom), layerNum(layerNum), isIndexed(isIndexed) { }
+
+	void addPoint(const Point &p, const map<string, vector_tile::Tile_Value> &attributes, const string *name) {
+		if (!geom::within(p, clippingBox)) { return; }
+		OutputObject oo(CACHED_POINT, layerNum, add(p));
+		oo.attributes = attributes;
+		layer.tileIndex[tileKey(lon2tilex(p.x(), baseZoom), latp2tiley(p.y(), baseZoom))].push_back(oo);
+		Box box; geom::envelope(p, box);
+		addToIndex(oo.objectID, box, name);
+	}
+
+	// Due to https://svn.boost.org/trac/boost/ticket/11268, we can't clip a MultiLinestring with Boost 1.56-1.58,
+	// so we need to create everything as polylines and clip individually :(
+	void addLinestring(const Linestring &ls, const map<string, vector_tile::Tile_Value> &attributes, const string *name) {
+		MultiLinestring out;
+		geom::intersection(ls, clippingBox, out);
+		for (auto &clipped : out) {
+			OutputObject oo(CACHED_LINESTRING, layerNum, add(clipped));
+			oo.attributes = attributes;
+			Box box; geom::envelope(clipped, box); oo.bbox.expand(box);
+			addToTileIndexPolyline(oo, layer.tileIndex, baseZoom, clipped);
+			addToIndex(oo.objectID, box, name);
+		}
+	}
+
+	void addPolygon(const MultiPolygon &mp, const map<string, vector_tile::Tile_Value> &attributes, const string *name) {
+		MultiPolygon out;
+		geom::intersection(mp, clippingBox, out);
+		if (boost::size(out)==0) { return; }
+		// (the OutputObject's bbox is the whole polygon's, even if split, so size checks are unchanged)
+		OutputObject oo(CACHED_POLYGON, layerNum, 0);
+		oo.attributes = attributes;
+		Box box; geom::envelope(out, box); oo.bbox.expand(box);
+		if (isIndexed) {
+			oo.objectID = add(move(out));
+			addToTileIndexByBbox(oo, layer.tileIndex, baseZoom, box.min_corner().get<0>(), box.min_corner().get<1>(), box.max_corner().get<0>(), box.max_corner().get<1>());
+			addToIndex(oo.objectID, box, name);
+		} else {
+			// add each piece to the tile index
+			for (auto &piece : splitPolygon(out, box, baseZoom)) {
+				Box pieceBox; geom::envelope(piece, pieceBox);
+				oo.objectID = add(move(piece));
+				addToTileIndexByBbox(oo, layer.tileIndex, baseZoom, pieceBox.min_corner().get<0>(), pieceBox.min_corner().get<1>(), pieceBox.max_corner().get<0>(), pieceBox.max_corner().get<1>());
+			}
+		}
+	}
+
+private:
+	Box clippingBox;
+	uint baseZoom, layerNum;
+	bool isIndexed;
+
+	uint add(Geometry &&g) {
+		layer.geometries.push_back(std::move(g));
+		return layer.geometries.size()-1;
+	}
+
+	void addToIndex(uint id, const Box &box, const string *name) {
+		if (!isIndexed) { return; }
+		layer.indexEntries.emplace_back(box, id);
+		if (name) { layer.names[id] = *name; }
+	}
+};
+
+// Read requested attributes from a shapefile
+void readShapefileAttributes(DBFHandle &dbf, map<string, vector_tile::Tile_Value> &attributes, int recordNum, unordered_map<int,string> &columnMap, unordered_map<int,int> &columnTypeMap) {
 	for (auto it : columnMap) {
 		int pos = it.first;
 		string key = it.second;
 		vector_tile::Tile_Value v;
 		switch (columnTypeMap[pos]) {
-			case 1:  v.set_int_value(DBFReadIntegerAttribute(dbf, recordNum, pos)); break;
+			case 1:  setIntegerValue(v, DBFReadIntegerAttribute(dbf, recordNum, pos)); break;
 			case 2:  v.set_double_value(DBFReadDoubleAttribute(dbf, recordNum, pos)); break;
 			default: v.set_string_value(DBFReadStringAttribute(dbf, recordNum, pos)); break;
 		}
-		oo.addAttribute(key, v);
+		attributes[key] = v;
 	}
 }
 
+// Find which records might be within the clipping box, from the envelope at the start of each
+// record, so that only those are read in full. The .shx file gives each record's offset in
+// the .shp file. (Shapefile doubles are little-endian, as is the host, we assume; if the .shx
+// can't be read, all records are returned.)
+vector<int> shapesInBox(const string &filename, int numEntities, const Box &clippingBox) {
+	vector<int> records;
+	boost::filesystem::path path(filename);
+	ifstream shx(boost::filesystem::path(path).replace_extension(".shx").string(), ios::in | ios::binary);
+	ifstream shp(boost::filesystem::path(path).replace_extension(".shp").string(), ios::in | ios::binary);
+	vector<unsigned char> offsets(numEntities * 8);
+	if (shx && shp) {
+		shx.seekg(100);
+		shx.read(reinterpret_cast<char *>(offsets.data()), offsets.size());
+	}
+	if (!shx || !shp) {
+		for (int i=0; i<numEntities; i++) { records.push_back(i); }
+		return records;
+	}
+
+	for (int i=0; i<numEntities; i++) {
+		const unsigned char *o = &offsets[i*8];
+		uint64_t offset = ((uint64_t(o[0])<<24) | (o[1]<<16) | (o[2]<<8) | o[3]) * 2;	// big-endian, in 16-bit words
+		int32_t shapeType;
+		double bounds[4];	// xmin, ymin, xmax, ymax (just x, y for points)
+		shp.seekg(offset + 8);
+		shp.read(reinterpret_cast<char *>(&shapeType), sizeof(shapeType));
+		if (!shp) { shp.clear(); records.push_back(i); continue; }	// (let shapelib deal with it)
+		if (shapeType==0) { continue; }									// null shape
+		int points = (shapeType==1 || shapeType==11 || shapeType==21) ? 1 : 2;
+		shp.read(reinterpret_cast<char *>(bounds), points * 2 * sizeof(double));
+		if (!shp) { shp.clear(); records.push_back(i); continue; }
+		if (points==1) { bounds[2]=bounds[0]; bounds[3]=bounds[1]; }
+		Box envelope(geom::make<Point>(bounds[0], lat2latp(fmin(fmax(bounds[1], MinLat), MaxLat))),
+		             geom::make<Point>(bounds[2], lat2latp(fmin(fmax(bounds[3], MinLat), MaxLat))));
+		if (geom::intersects(envelope, clippingBox)) { records.push_back(i); }
+	}
+	return records;
+}
 
 // Read shapefile, and create OutputObjects for all objects within the specified bounding box
-void readShapefile(string filename, 
-                   vector<string> &columns,
-                   Box &clippingBox, 
-                   map< uint, vector<OutputObject> > &tileIndex, 
-                   vector<Geometry> &cachedGeometries, map< uint, string > &cachedGeometryNames,
-                   uint baseZoom, uint layerNum, string &layerName,
-                   bool isIndexed, map<string,RTree> &indices, string &indexName) {
+// (arguments are taken by value, as this runs on its own thread)
+ShapefileLayer readShapefile(string filename,
+                             vector<string> columns,
+                             Box clippingBox,
+                             uint baseZoom, uint layerNum,
+                             bool isIndexed, string indexName) {
+
+	LayerBuilder builder(clippingBox, baseZoom, layerNum, isIndexed);
 
 	// open shapefile
 	SHPHandle shp = SHPOpen(filename.c_str(), "rb");
 	DBFHandle dbf = DBFOpen(filename.c_str(), "rb");
+	if (!shp || !dbf) {
+		if (shp) { SHPClose(shp); }
+		if (dbf) { DBFClose(dbf); }
+		throw runtime_error("Couldn't open shapefile " + filename);
+	}
 	int numEntities, shpType;
 	vector<Point> points;
-	geom::model::box<Point> box;
 	double adfMinBound[4], adfMaxBound[4];
 	SHPGetInfo(shp, &numEntities, &shpType, adfMinBound, adfMaxBound);
 	
@@ -106,48 +283,32 @@ void readShapefile(string filename,
 	int indexField=-1;
 	if (indexName!="") { indexField = DBFGetFieldIndex(dbf,indexName.c_str()); }
 
-	for (int i=0; i<numEntities; i++) {
+	vector<int> records;
+	Box fileBox(geom::make<Point>(adfMinBound[0], lat2latp(fmin(fmax(adfMinBound[1], MinLat), MaxLat))),
+	            geom::make<Point>(adfMaxBound[0], lat2latp(fmin(fmax(adfMaxBound[1], MinLat), MaxLat))));
+	if (geom::intersects(fileBox, clippingBox)) { records = shapesInBox(filename, numEntities, clippingBox); }
+
+	for (int i : records) {
 		SHPObject* shape = SHPReadObject(shp, i);
+		if (!shape) { continue; }
 		int shapeType = shape->nSHPType;	// 1=point, 3=polyline, 5=(multi)polygon [8=multipoint, 11+=3D]
+		map<string, vector_tile::Tile_Value> attributes;
+		readShapefileAttributes(dbf, attributes, i, columnMap, columnTypeMap);
+		string name;
+		if (isIndexed && indexField>-1) { name = DBFReadStringAttribute(dbf, i, indexField); }
+		const string *namePtr = (isIndexed && indexField>-1) ? &name : nullptr;
 	
 		if (shapeType==1) {
 			// Points
-			Point p( shape->padfX[0], lat2latp(shape->padfY[0]) );
-			if (geom::within(p, clippingBox)) {
-				uint tilex =  lon2tilex(p.x(), baseZoom);
-				uint tiley = latp2tiley(p.y(), baseZoom);
-				cachedGeometries.push_back(p);
-				OutputObject oo(CACHED_POINT, layerNum, cachedGeometries.size()-1);
-				addShapefileAttributes(dbf,oo,i,columnMap,columnTypeMap);
-				tileIndex[tilex*65536+tiley].push_back(oo);
-				if (isIndexed) {
-					uint id = cachedGeometries.size()-1;
-					geom::envelope(p, box); indices[layerName].insert(std::make_pair(box, id));
-					if (indexField>-1) { cachedGeometryNames[id]=DBFReadStringAttribute(dbf, i, indexField); }
-				}
-			}
+			builder.addPoint(Point(shape->padfX[0], lat2latp(shape->padfY[0])), attributes, namePtr);
 
 		} else if (shapeType==3) {
 			// (Multi)-polylines
-			// Due to https://svn.boost.org/trac/boost/ticket/11268, we can't clip a MultiLinestring with Boost 1.56-1.58, 
-			// so we need to create everything as polylines and clip individually :(
 			for (uint j=0; j<shape->nParts; j++) {
 				Linestring ls;
 				fillPointArrayFromShapefile(&points, shape, j);
 				geom::assign_points(ls, points);
-				MultiLinestring out;
-				geom::intersection(ls, clippingBox, out);
-				for (MultiLinestring::const_iterator it = out.begin(); it != out.end(); ++it) {
-					cachedGeometries.push_back(*it);
-					OutputObject oo(CACHED_LINESTRING, layerNum, cachedGeometries.size()-1);
-					addShapefileAttributes(dbf,oo,i,columnMap,columnTypeMap);
-					addToTileIndexPolyline(oo, tileIndex, baseZoom, *it);
-					if (isIndexed) {
-						uint id = cachedGeometries.size()-1;
-						geom::envelope(*it, box); indices[layerName].insert(std::make_pair(box, id));
-						if (indexField>-1) { cachedGeometryNames[id]=DBFReadStringAttribute(dbf, i, indexField); }
-					}
-				}
+				builder.addLinestring(ls, attributes, namePtr);
 			}
 
 		} else if (shapeType==5) {
@@ -199,30 +360,144 @@ void readShapefile(string filename,
 				}
 				cerr << endl;
 			}
-			// clip to bounding box
-			MultiPolygon out;
-			geom::intersection(multi, clippingBox, out);
-			if (boost::size(out)>0) {
-				// create OutputObject
-				cachedGeometries.push_back(out);
-				OutputObject oo(CACHED_POLYGON, layerNum, cachedGeometries.size()-1);
-				addShapefileAttributes(dbf,oo,i,columnMap,columnTypeMap);
-				// add to tile index
-				geom::model::box<Point> box;
-				geom::envelope(out, box);
-				addToTileIndexByBbox(oo, tileIndex, baseZoom, box.min_corner().get<0>(), box.min_corner().get<1>(), box.max_corner().get<0>(), box.max_corner().get<1>());
-				if (isIndexed) {
-					uint id = cachedGeometries.size()-1;
-					indices[layerName].insert(std::make_pair(box, id));
-					if (indexField>-1) { cachedGeometryNames[id]=DBFReadStringAttribute(dbf, i, indexField); }
-				}
-			}
+			builder.addPolygon(multi, attributes, namePtr);
 
 		} else {
 			// Not supported
 			cerr << "Shapefile entity #" << i << " type " << shapeType << " not supported" << endl;
 		}
+		SHPDestroyObject(shape);
 	}
 	SHPClose(shp);
 	DBFClose(dbf);
+	return move(builder.layer);
+}
+
+// Add a layer that's been read to the global stores, offsetting its geometry IDs
+// (its spatial index, if any, is built in one go, which packs it better than inserting each entry)
+void mergeShapefileLayer(ShapefileLayer &layer, map< TileKey, vector<OutputObject> > &tileIndex,
+                         vector<Geometry> &cachedGeometries, map< uint, string > &cachedGeometryNames,
+                         RTree *index, uint indexCapacity) {
+	uint offset = cachedGeometries.size();
+	cachedGeometries.insert(cachedGeometries.end(), std::make_move_iterator(layer.geometries.begin()), std::make_move_iterator(layer.geometries.end()));
+	for (auto &it : layer.tileIndex) {
+		vector<OutputObject> &ooList = tileIndex[it.first];
+		for (auto &oo : it.second) {
+			oo.objectID += offset;
+			ooList.push_back(move(oo));
+		}
+	}
+	for (auto &it : layer.names) { cachedGeometryNames[it.first + offset] = move(it.second); }
+	if (index) {
+		for (auto &entry : layer.indexEntries) { entry.second += offset; }
+		*index = RTree(layer.indexEntries.begin(), layer.indexEntries.end(), geom::index::dynamic_quadratic(indexCapacity));
+	}
+	layer = ShapefileLayer();
+}
+
+// ----	Caching layers that have been read
+//		With --shapefile-cache, each layer is saved after it's read, and loaded from the cache
+//		next time instead of being read, clipped and split again. The cache file is named from a
+//		hash of the key (the source's path and modification times, the bounding box, the columns
+//		and so on), and starts with the key itself, so a changed source or config is read afresh.
+
+static constexpr const char *SHAPEFILE_CACHE_MAGIC = "tilemaker shapefile cache 1\n";
+
+string shapefileCacheKey(const string &filename, const vector<string> &columns, const Box &clippingBox,
+                         uint baseZoom, bool isIndexed, const string &indexName) {
+	boost::system::error_code ec;
+	boost::filesystem::path path = boost::filesystem::absolute(filename);
+	time_t shpTime = boost::filesystem::last_write_time(path, ec);
+	if (ec) { return ""; }
+	time_t dbfTime = boost::filesystem::last_write_time(boost::filesystem::path(path).replace_extension(".dbf"), ec);
+	if (ec) { dbfTime = 0; }	// (not a shapefile)
+
+	ostringstream key;
+	key.precision(17);
+	key << path.string() << "\n" << shpTime << " " << dbfTime << "\n"
+	    << clippingBox.min_corner().get<0>() << " " << clippingBox.min_corner().get<1>() << " "
+	    << clippingBox.max_corner().get<0>() << " " << clippingBox.max_corner().get<1>() << "\n"
+	    << baseZoom << " " << isIndexed << " " << indexName << "\n";
+	for (auto &column : columns) { key << column << "\n"; }
+	return key.str();
+}
+
+void saveShapefileCache(const string &cacheFile, const string &key, const ShapefileLayer &layer) {
+	// (unique, as layers with the same source and settings are read at the same time)
+	string tempFile = boost::filesystem::unique_path(cacheFile + ".%%%%-%%%%-%%%%.tmp").string();
+	ofstream out(tempFile, ios::out | ios::trunc | ios::binary);
+	out << SHAPEFILE_CACHE_MAGIC;
+	write_string(out, key);
+	write_raw<uint64_t>(out, layer.geometries.size());
+	for (auto &geometry : layer.geometries) { TileIndexFile::writeGeometry(out, geometry); }
+	write_raw<uint64_t>(out, layer.names.size());
+	for (auto &it : layer.names) { write_raw<uint32_t>(out, it.first); write_string(out, it.second); }
+	write_raw<uint64_t>(out, layer.tileIndex.size());
+	for (auto &it : layer.tileIndex) {
+		write_raw(out, it.first);
+		write_raw<uint64_t>(out, it.second.size());
+		for (auto &oo : it.second) { oo.write(out); }
+	}
+	write_vector(out, layer.indexEntries);
+	out.close();
+	// (written under another name first, so another run never sees half a file)
+	if (!out || rename(tempFile.c_str(), cacheFile.c_str())!=0) {
+		remove(tempFile.c_str());
+		cerr << "Couldn't write shapefile cache " << cacheFile << endl;
+	}
+}
+
+// Returns false if there's no cache file for this key
+bool loadShapefileCache(const string &cacheFile, const string &key, uint layerNum, ShapefileLayer &layer) {
+	ifstream in(cacheFile, ios::in | ios::binary);
+	if (!in) { return false; }
+	string magic(strlen(SHAPEFILE_CACHE_MAGIC), 0);
+	in.read(&magic[0], magic.size());
+	if (!in || magic != SHAPEFILE_CACHE_MAGIC || read_string(in) != key) { return false; }
+
+	for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) { layer.geometries.push_back(TileIndexFile::readGeometry(in)); }
+	for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+		uint32_t id = read_raw<uint32_t>(in);
+		layer.names[id] = read_string(in);
+	}
+	for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+		vector<OutputObject> &ooList = layer.tileIndex[read_raw<TileKey>(in)];
+		for (uint64_t m = read_raw<uint64_t>(in); m>0; m--) {
+			ooList.push_back(OutputObject::read(in));
+			ooList.back().layer = layerNum;		// (the layer's position in the config may have changed)
+		}
+	}
+	layer.indexEntries = read_vector<IndexValue>(in);
+	return true;
+}
+
+// Read a layer with the given reader (readShapefile or readFlatGeobuf), or load it from the
+// cache directory if it's been read before
+typedef ShapefileLayer (*LayerReader)(string, vector<string>, Box, uint, uint, bool, string);
+
+ShapefileLayer readShapefileCached(string cacheDir,
+                                   LayerReader reader,
+                                   string filename,
+                                   vector<string> columns,
+                                   Box clippingBox,
+                                   uint baseZoom, uint layerNum,
+                                   bool isIndexed, string indexName) {
+	string key = cacheDir.empty() ? "" : shapefileCacheKey(filename, columns, clippingBox, baseZoom, isIndexed, indexName);
+	if (key.empty()) { return reader(filename, columns, clippingBox, baseZoom, layerNum, isIndexed, indexName); }
+
+	ostringstream cacheName;
+	cacheName << hex << hash<string>()(key) << ".cache";
+	string cacheFile = (boost::filesystem::path(cacheDir) / cacheName.str()).string();
+	ShapefileLayer layer;
+	try {
+		if (loadShapefileCache(cacheFile, key, layerNum, layer)) {
+			cout << "Loaded " << filename << " from cache" << endl;
+			return layer;
+		}
+	} catch (exception &e) {
+		cerr << "Couldn't read shapefile cache " << cacheFile << " (" << e.what() << "), reading " << filename << " again" << endl;
+	}
+	layer = reader(filename, columns, clippingBox, baseZoom, layerNum, isIndexed, indexName);
+	saveShapefileCache(cacheFile, key, layer);
+	return layer;
 }
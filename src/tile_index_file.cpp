@@ -0,0 +1,189 @@
+/*
+	TileIndexFile - save the result of reading the input, so tiles can be written by a later run
+
+	--save-index writes everything the output phase needs: the OSM store, the geometries read
+	from shapefiles, and the tile index with each object's attributes. --load-index reads it
+	back instead of the .pbf and shapefiles (and without running Lua), so tiles can be written
+	again with different zoom levels, compression, simplification or sharding.
+
+	File layout:
+		header (magic, base zoom, clipping box)
+		OSM store
+		cached geometries and their names
+		objects for each base-zoom tile, one tile after another
+		tile directory: fixed-size (Morton key, offset, count) entries in key order
+		trailer: offset and number of directory entries
+
+	The directory is read first, then only the tiles that the current run will write (e.g. those
+	in its shard) are read from the file.
+*/
+
+class TileIndexFile { public:
+
+	static constexpr const char *MAGIC = "tilemaker index 1\n";
+
+	uint baseZoom = 0;
+	Box clippingBox;
+	bool hasClippingBox = false;
+
+	static void save(const string &filename, uint baseZoom, const Box &clippingBox, bool hasClippingBox,
+	                 const OSMStore &osmStore, const vector<Geometry> &cachedGeometries, const map<uint, string> &cachedGeometryNames,
+	                 const map< TileKey, vector<OutputObject> > &tileIndex) {
+		ofstream out(filename, ios::out | ios::trunc | ios::binary);
+		out << MAGIC;
+		write_raw<uint32_t>(out, baseZoom);
+		write_raw<uint8_t>(out, hasClippingBox);
+		for (double v : { clippingBox.min_corner().get<0>(), clippingBox.min_corner().get<1>(),
+		                  clippingBox.max_corner().get<0>(), clippingBox.max_corner().get<1>() }) { write_raw(out, v); }
+
+		osmStore.save(out);
+		write_raw<uint64_t>(out, cachedGeometries.size());
+		for (auto &geometry : cachedGeometries) { writeGeometry(out, geometry); }
+		write_raw<uint64_t>(out, cachedGeometryNames.size());
+		for (auto &it : cachedGeometryNames) { write_raw<uint32_t>(out, it.first); write_string(out, it.second); }
+
+		vector<DirectoryEntry> directory;
+		directory.reserve(tileIndex.size());
+		for (auto &it : tileIndex) {
+			directory.push_back(DirectoryEntry { it.first, uint64_t(out.tellp()), uint32_t(it.second.size()) });
+			for (auto &oo : it.second) { oo.write(out); }
+		}
+		uint64_t directoryOffset = out.tellp();
+		for (auto &entry : directory) { write_raw(out, entry.key); write_raw(out, entry.offset); write_raw(out, entry.count); }
+		write_raw(out, directoryOffset);
+		write_raw<uint64_t>(out, directory.size());
+
+		out.close();
+		if (!out) { throw runtime_error("Couldn't write index " + filename); }
+	}
+
+	// Read everything except the tiles
+	void open(const string &filename, OSMStore &osmStore, vector<Geometry> &cachedGeometries, map<uint, string> &cachedGeometryNames) {
+		in.open(filename, ios::in | ios::binary);
+		if (!in) { throw runtime_error("Couldn't open index " + filename); }
+		string magic(strlen(MAGIC), 0);
+		in.read(&magic[0], magic.size());
+		if (magic != MAGIC) { throw runtime_error(filename + " isn't a tilemaker index"); }
+		baseZoom = read_raw<uint32_t>(in);
+		hasClippingBox = read_raw<uint8_t>(in);
+		double minLon = read_raw<double>(in), minLatp = read_raw<double>(in);
+		double maxLon = read_raw<double>(in), maxLatp = read_raw<double>(in);
+		clippingBox = Box(geom::make<Point>(minLon, minLatp), geom::make<Point>(maxLon, maxLatp));
+
+		osmStore.load(in);
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) { cachedGeometries.push_back(readGeometry(in)); }
+		for (uint64_t n = read_raw<uint64_t>(in); n>0; n--) {
+			uint32_t id = read_raw<uint32_t>(in);
+			cachedGeometryNames[id] = read_string(in);
+		}
+
+		in.seekg(-2 * int(sizeof(uint64_t)), ios::end);
+		uint64_t directoryOffset = read_raw<uint64_t>(in);
+		uint64_t entries = read_raw<uint64_t>(in);
+		in.seekg(directoryOffset);
+		directory.resize(entries);
+		for (auto &entry : directory) {
+			entry.key = read_raw<TileKey>(in);
+			entry.offset = read_raw<uint64_t>(in);
+			entry.count = read_raw<uint32_t>(in);
+		}
+	}
+
+	// Read the base-zoom tiles for which include(key) is true into the tile index
+	template <typename F>
+	void readTiles(map< TileKey, vector<OutputObject> > &tileIndex, F include) {
+		for (auto &entry : directory) {
+			if (!include(entry.key)) { continue; }
+			in.seekg(entry.offset);
+			auto &ooList = tileIndex[entry.key];
+			ooList.reserve(ooList.size() + entry.count);
+			for (uint32_t i=0; i<entry.count; i++) { ooList.push_back(OutputObject::read(in)); }
+		}
+	}
+
+	// ----	Geometries: a type (position in the Geometry variant), then counts and coordinates
+	//		(also used by the shapefile cache)
+
+	template <typename Range>
+	static void writePoints(ostream &out, const Range &points) {
+		write_raw<uint32_t>(out, boost::size(points));
+		for (auto &p : points) { write_raw(out, p.x()); write_raw(out, p.y()); }
+	}
+	template <typename Range>
+	static void readPoints(istream &in, Range &points) {
+		for (uint32_t n = read_raw<uint32_t>(in); n>0; n--) {
+			double x = read_raw<double>(in);
+			points.push_back(Point(x, read_raw<double>(in)));
+		}
+	}
+
+	static void writeGeometry(ostream &out, const Geometry &geometry) {
+		write_raw<uint8_t>(out, geometry.which());
+		switch (geometry.which()) {
+			case 0: {
+				const Point &p = boost::get<Point>(geometry);
+				write_raw(out, p.x()); write_raw(out, p.y());
+				break;
+			}
+			case 1:
+				writePoints(out, boost::get<Linestring>(geometry));
+				break;
+			case 2: {
+				const MultiLinestring &mls = boost::get<MultiLinestring>(geometry);
+				write_raw<uint32_t>(out, mls.size());
+				for (auto &ls : mls) { writePoints(out, ls); }
+				break;
+			}
+			case 3: {
+				const MultiPolygon &mp = boost::get<MultiPolygon>(geometry);
+				write_raw<uint32_t>(out, mp.size());
+				for (auto &polygon : mp) {
+					writePoints(out, polygon.outer());
+					write_raw<uint32_t>(out, polygon.inners().size());
+					for (auto &inner : polygon.inners()) { writePoints(out, inner); }
+				}
+				break;
+			}
+		}
+	}
+
+	static Geometry readGeometry(istream &in) {
+		switch (read_raw<uint8_t>(in)) {
+			case 0: {
+				double x = read_raw<double>(in);
+				return Point(x, read_raw<double>(in));
+			}
+			case 1: {
+				Linestring ls;
+				readPoints(in, ls);
+				return ls;
+			}
+			case 2: {
+				MultiLinestring mls;
+				mls.resize(read_raw<uint32_t>(in));
+				for (auto &ls : mls) { readPoints(in, ls); }
+				return mls;
+			}
+			case 3: {
+				MultiPolygon mp;
+				mp.resize(read_raw<uint32_t>(in));
+				for (auto &polygon : mp) {
+					readPoints(in, polygon.outer());
+					polygon.inners().resize(read_raw<uint32_t>(in));
+					for (auto &inner : polygon.inners()) { readPoints(in, inner); }
+				}
+				return mp;
+			}
+		}
+		throw runtime_error("Unknown geometry type in index");
+	}
+
+private:
+	struct DirectoryEntry {
+		TileKey key;
+		uint64_t offset;
+		uint32_t count;
+	};
+	ifstream in;
+	vector<DirectoryEntry> directory;
+};
@@ -0,0 +1,112 @@
+/*
+	TileServer - serve tiles over HTTP, generating each one when it's first asked for
+
+	Used by --serve: once the .pbf has been read, the OSM store and tile index stay in memory,
+	and each request for /z/x/y.pbf is built with the same TileBuilder as batch output.
+	Tiles are compressed at the same per-zoom level and strategy as batch output.
+	Recently served tiles are kept in an LRU cache. Requests are handled one at a time,
+	as it's meant for development and light use on the local machine.
+*/
+
+class TileServer { public:
+
+	TileServer(TileBuilder &builder, const map< TileKey, vector<OutputObject> > &index,
+	           uint baseZoom, uint startZoom, uint endZoom, bool compress, bool gzip,
+	           const vector<int> &levels, const vector<int> &strategies, uint cacheSize) :
+		tileBuilder(builder), tileIndex(index), baseZoom(baseZoom), startZoom(startZoom), endZoom(endZoom),
+		compress(compress), gzip(gzip), levels(levels), strategies(strategies), compressor(gzip),
+		cacheSize(max(cacheSize,1u)) { }
+
+	// Listen on the given port (on localhost) until the process is stopped
+	void run(unsigned short port) {
+		using boost::asio::ip::tcp;
+		boost::asio::io_service io;
+		tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+		cout << "Serving tiles at http://localhost:" << port << "/{z}/{x}/{y}.pbf" << endl;
+		while (true) {
+			tcp::socket socket(io);
+			acceptor.accept(socket);
+			try {
+				handle(socket);
+			} catch (exception &e) {
+				cerr << "Error serving request: " << e.what() << endl;
+			}
+		}
+	}
+
+private:
+	TileBuilder &tileBuilder;
+	const map< TileKey, vector<OutputObject> > &tileIndex;
+	uint baseZoom, startZoom, endZoom;
+	bool compress, gzip;
+	vector<int> levels, strategies;						// per zoom level, as for CompressionPool
+	Compressor compressor;
+	uint cacheSize;
+
+	typedef list<pair<uint64_t, string>> CacheList;
+	CacheList cache;									// most recently used first
+	unordered_map<uint64_t, CacheList::iterator> cacheIndex;
+
+	void handle(boost::asio::ip::tcp::socket &socket) {
+		boost::asio::streambuf request;
+		boost::asio::read_until(socket, request, "\r\n\r\n");
+		istream in(&request);
+		string method, path, version;
+		in >> method >> path >> version;
+
+		uint zoom, x, y;
+		char ext[8] = "";
+		if (method != "GET") {
+			respond(socket, "405 Method Not Allowed", "", "");
+		} else if (sscanf(path.c_str(), "/%u/%u/%u.%7s", &zoom, &x, &y, ext) != 4 || strcmp(ext, "pbf") != 0) {
+			respond(socket, "404 Not Found", "", "");
+		} else if (zoom < startZoom || zoom > endZoom || x >= (1u << zoom) || y >= (1u << zoom)) {
+			respond(socket, "404 Not Found", "", "");
+		} else {
+			const string &data = getTile(zoom, x, y);
+			if (data.empty()) { respond(socket, "204 No Content", "", ""); }
+			else { respond(socket, "200 OK", data, !compress ? "" : gzip ? "gzip" : "deflate"); }
+		}
+	}
+
+	// Get a tile from the cache, or generate it
+	const string &getTile(uint zoom, uint x, uint y) {
+		uint64_t key = (uint64_t(1) << (2*zoom)) | tileKey(x, y);	// (marker bit keeps zoom levels apart)
+		auto found = cacheIndex.find(key);
+		if (found != cacheIndex.end()) {
+			cache.splice(cache.begin(), cache, found->second);
+			return found->second->second;
+		}
+
+		TileKey index = tileKey(x, y);
+		vector<OutputObject> ooList = tileBuilder.gather(tileIndex, index, zoom, baseZoom);
+		string output;
+		if (!ooList.empty()) {
+			TileBbox bbox(index, zoom);
+			string data = tileBuilder.generate(zoom, bbox, ooList);
+			output = compress ? compressor.compress(data, zoomSetting(levels, zoom, Z_DEFAULT_COMPRESSION), zoomSetting(strategies, zoom, Z_DEFAULT_STRATEGY)) : data;
+		}
+
+		cache.emplace_front(key, move(output));
+		cacheIndex[key] = cache.begin();
+		if (cache.size() > cacheSize) {
+			cacheIndex.erase(cache.back().first);
+			cache.pop_back();
+		}
+		return cache.front().second;
+	}
+
+	static void respond(boost::asio::ip::tcp::socket &socket, const string &status, const string &body, const string &encoding) {
+		ostringstream header;
+		header << "HTTP/1.1 " << status << "\r\n"
+		       << "Access-Control-Allow-Origin: *\r\n"
+		       << "Content-Length: " << body.size() << "\r\n"
+		       << "Connection: close\r\n";
+		if (!body.empty()) { header << "Content-Type: application/vnd.mapbox-vector-tile\r\n"; }
+		if (!encoding.empty()) { header << "Content-Encoding: " << encoding << "\r\n"; }
+		header << "\r\n";
+		string headerText = header.str();
+		array<boost::asio::const_buffer, 2> buffers = {{ boost::asio::buffer(headerText), boost::asio::buffer(body) }};
+		boost::asio::write(socket, buffers);
+	}
+};
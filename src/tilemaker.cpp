@@ -13,11 +13,27 @@
 #include <string>
 #include <cmath>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <list>
+#include <atomic>
+#include <climits>
+#include <future>
 
 // Other utilities
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/variant.hpp>
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
@@ -60,7 +76,7 @@ typedef boost::geometry::ring_type<Polygon>::type Ring;
 typedef boost::geometry::interior_type<Polygon>::type InteriorRing;
 typedef boost::variant<Point,Linestring,MultiLinestring,MultiPolygon> Geometry;
 typedef std::pair<Box, uint> IndexValue;
-typedef boost::geometry::index::rtree< IndexValue, boost::geometry::index::quadratic<16> > RTree;
+typedef boost::geometry::index::rtree< IndexValue, boost::geometry::index::dynamic_quadratic > RTree;	// (node capacity set per layer)
 
 // Namespaces
 using namespace std;
@@ -84,11 +100,20 @@ typedef vector<NodeID> NodeVec;
 typedef vector<WayID> WayVec;
 
 #include "osm_store.cpp"
+#include "ingest_filter.cpp"
 #include "output_object.cpp"
 #include "osm_object.cpp"
+#include "osm_change.cpp"
+#include "tile_index_file.cpp"
 #include "mbtiles.cpp"
+#include "write_directory.cpp"
+#include "pmtiles.cpp"
 #include "read_shp.cpp"
+#include "read_fgb.cpp"
 #include "write_geometry.cpp"
+#include "write_tile.cpp"
+#include "tile_server.cpp"
+#include "compression_pool.cpp"
 
 int lua_error_handler(lua_State* luaState)
 {
@@ -103,38 +128,56 @@ int lua_error_handler(lua_State* luaState)
 
 int main(int argc, char* argv[]) {
 
-	// ----	Initialise data collections
-
-	OSMStore osmStore;									// global OSM store
-	NodeStore &nodes = osmStore.nodes;
-	WayStore &ways = osmStore.ways;
-	RelationStore &relations = osmStore.relations;
-
-	map<string, RTree> indices;						// boost::geometry::index objects for shapefile indices
-	vector<Geometry> cachedGeometries;					// prepared boost::geometry objects (from shapefiles)
-	map<uint, string> cachedGeometryNames;			//  | optional names for each one
-
-	map< uint, vector<OutputObject> > tileIndex;				// objects to be output
-	map< WayID, vector<OutputObject> > relationOutputObjects;	// outputObjects for multipolygons (saved for processing later as ways)
-	map< WayID, vector<WayID> > wayRelations;					// for each way, which relations it's in (therefore we need to keep them)
-
 	// ----	Read command-line options
 	
-	bool sqlite=false;
+	bool sqlite=false, pmtiles=false;
 	vector<string> inputFiles;
 	string outputFile;
 	string luaFile;
 	string jsonFile;
+	string validateFile;
 	bool verbose = false;
+	bool bulkLoad = false, vacuum = false, mergeMbtiles = false, changedOnly = false, watch = false;
+	uint outputShards = 1;
+	uint writeThreads = 4;
+	uint compressThreads = max(thread::hardware_concurrency(), 1u);
+	string shardSpec;
+	vector<string> shardBoxes;
+	bool shardPrune = false;
+	TileShard shard;
+	string saveSnapshot, loadSnapshot, expireList;
+	string saveIndex, loadIndex, shapefileCache;
+	vector<string> changeFiles;
+	uint servePort = 0, serveCache = 10000;
 
 	po::options_description desc("tilemaker (c) 2016 Richard Fairhurst and contributors\nConvert OpenStreetMap .pbf files into vector tiles\n\nAvailable options");
 	desc.add_options()
 		("help",                                                                 "show help message")
 		("input",  po::value< vector<string> >(&inputFiles),                     "source .osm.pbf file")
-		("output", po::value< string >(&outputFile),                             "target directory or .mbtiles/.sqlite file")
+		("output", po::value< string >(&outputFile),                             "target directory, .mbtiles/.sqlite file or .pmtiles file")
 		("config", po::value< string >(&jsonFile)->default_value("config.json"), "config JSON file")
 		("process",po::value< string >(&luaFile)->default_value("process.lua"),  "tag-processing Lua file")
-		("verbose",po::bool_switch(&verbose),                                    "verbose error output");
+		("verbose",po::bool_switch(&verbose),                                    "verbose error output")
+		("bulk-load",po::bool_switch(&bulkLoad),                                 "faster writing of new .mbtiles files (indexed at the end)")
+		("vacuum", po::bool_switch(&vacuum),                                     "vacuum .mbtiles file when finished")
+		("changed-only",po::bool_switch(&changedOnly),                           "only write tiles that differ from those in an existing .mbtiles file")
+		("output-shards",po::value< uint >(&outputShards)->default_value(1),     "write .mbtiles output as this many files in parallel, then merge them")
+		("merge-mbtiles",po::bool_switch(&mergeMbtiles),                         "merge the input .mbtiles files into the output file")
+		("write-threads",po::value< uint >(&writeThreads)->default_value(4),     "threads writing tiles to an output directory")
+		("compress-threads",po::value< uint >(&compressThreads),                 "threads compressing tiles (default: one per core)")
+		("watch",  po::bool_switch(&watch),                                      "render again whenever the Lua or JSON file changes")
+		("serve",  po::value< uint >(&servePort),                                "serve tiles over HTTP on this port, instead of writing them")
+		("serve-cache",po::value< uint >(&serveCache)->default_value(10000),     "tiles to keep in memory when serving")
+		("validate",po::value< string >(&validateFile),                          "check a .pmtiles file and exit")
+		("shard",  po::value< string >(&shardSpec),                              "only write shard i/n of the tiles (e.g. 0/4)")
+		("shard-bbox",po::value< vector<string> >(&shardBoxes),                  "only write tiles within minlon,minlat,maxlon,maxlat (may be repeated)")
+		("shard-prune",po::bool_switch(&shardPrune),                             "discard objects outside the shard while reading")
+		("save-snapshot",po::value< string >(&saveSnapshot),                     "save the OSM data and Lua output, for updating later")
+		("load-snapshot",po::value< string >(&loadSnapshot),                     "update from a snapshot, applying .osc change files given as input")
+		("save-index",po::value< string >(&saveIndex),                           "save the tile index after reading, for writing tiles later")
+		("load-index",po::value< string >(&loadIndex),                           "write tiles from a saved index, instead of reading .pbf files")
+		("shapefile-cache",po::value< string >(&shapefileCache),                 "directory to cache shapefile layers in once they've been read")
+		("expire-list",po::value< string >(&expireList),                         "write the z/x/y of each tile written or deleted to this file");
 	po::positional_options_description p;
 	p.add("input", -1);
 	po::variables_map vm;
@@ -142,718 +185,987 @@ int main(int argc, char* argv[]) {
 	po::notify(vm);
 	
 	if (vm.count("help")) { cout << desc << endl; return 1; }
-	if (vm.count("output")==0) { cerr << "You must specify an output file or directory. Run with --help to find out more." << endl; return -1; }
-	if (vm.count("input")==0) { cerr << "You must specify at least one source .osm.pbf file. Run with --help to find out more." << endl; return -1; }
+
+	// ----	Check a .pmtiles file, if that's all we're doing
+
+	if (!validateFile.empty()) {
+		try {
+			PMTilesReader reader;
+			reader.open(validateFile);
+			return reader.validate(verbose) ? 0 : -1;
+		} catch (exception &e) { cerr << validateFile << ": " << e.what() << endl; return -1; }
+	}
+
+	if (vm.count("output")==0 && servePort==0 && saveIndex.empty()) { cerr << "You must specify an output file or directory. Run with --help to find out more." << endl; return -1; }
+	if (vm.count("input")==0 && loadSnapshot.empty() && loadIndex.empty()) { cerr << "You must specify at least one source .osm.pbf file. Run with --help to find out more." << endl; return -1; }
 
 	if (ends_with(outputFile, ".mbtiles") || ends_with(outputFile, ".sqlite")) {
 		sqlite=true;
+	} else if (ends_with(outputFile, ".pmtiles")) {
+		pmtiles=true;
+	}
+
+	// ----	Merge existing .mbtiles files, if that's all we're doing
+
+	if (mergeMbtiles) {
+		if (!sqlite) { cerr << "--merge-mbtiles needs an .mbtiles output file." << endl; return -1; }
+		for (auto &inputFile : inputFiles) {
+			if (!boost::filesystem::exists(inputFile)) { cerr << "Couldn't find " << inputFile << " to merge." << endl; return -1; }
+		}
+		MBTiles merged;
+		try {
+			merged.open(&outputFile, MBTiles::isDeduplicated(inputFiles[0]), bulkLoad);
+			merged.vacuum = vacuum;
+			for (auto inputFile : inputFiles) {
+				cout << "Merging " << inputFile << endl;
+				merged.merge(inputFile);
+			}
+			merged.close();
+		} catch (exception &e) { cerr << "Couldn't merge into " << outputFile << ": " << e.what() << endl; return -1; }
+		return 0;
+	}
+	if (outputShards==0) { outputShards = 1; }
+	if (!shardSpec.empty() && !shard.parse(shardSpec)) { cerr << "--shard should be i/n, where i is from 0 to n-1." << endl; return -1; }
+	for (auto &box : shardBoxes) {
+		if (!shard.addBox(box)) { cerr << "--shard-bbox should be minlon,minlat,maxlon,maxlat." << endl; return -1; }
+	}
+	if (shardPrune && !shard.active()) { shardPrune = false; }
+	bool loadingIndex = !loadIndex.empty();
+	if (loadingIndex && (!loadSnapshot.empty() || !inputFiles.empty())) { cerr << "--load-index replaces the input, so can't be used with input files or --load-snapshot." << endl; return -1; }
+	if (watch && (servePort>0 || !loadSnapshot.empty())) { cerr << "--watch can't be used with --serve or --load-snapshot." << endl; return -1; }
+	if (changedOnly && (!sqlite || outputShards>1)) { cerr << "--changed-only needs a single .mbtiles output file." << endl; return -1; }
+	if (!shapefileCache.empty()) {
+		boost::system::error_code ec;
+		boost::filesystem::create_directories(shapefileCache, ec);
+		if (ec) { cerr << "Couldn't create shapefile cache directory " << shapefileCache << ": " << ec.message() << endl; return -1; }
+	}
+
+	// In update mode, the inputs are change files, not .pbfs
+	bool updating = !loadSnapshot.empty();
+	if (updating) {
+		if (!sqlite) { cerr << "--load-snapshot needs an .mbtiles output file to update." << endl; return -1; }
+		if (outputShards>1 || shard.active() || bulkLoad) { cerr << "--load-snapshot can't be used with sharding or --bulk-load." << endl; return -1; }
+		changeFiles.swap(inputFiles);
 	}
 
 	#ifdef COMPACT_NODES
 	cout << "tilemaker compiled without 64-bit node support, use 'osmium renumber' first if working with OpenStreetMap-sourced data" << endl;
 	#endif
 
-	// ----	Read bounding box from first .pbf
-
-	Box clippingBox;
-	bool hasClippingBox = false;
-	bool clippingBoxFromJSON = false;
-	fstream infile(inputFiles[0], ios::in | ios::binary);
-	if (!infile) { cerr << "Couldn't open .pbf file " << inputFiles[0] << endl; return -1; }
-	HeaderBlock block;
-	readBlock(&block, &infile);
-	if (block.has_bbox()) {
-		hasClippingBox = true;
-		double minLon = block.bbox().left()  /1000000000.0;
-		double maxLon = block.bbox().right() /1000000000.0;
-		double minLat = block.bbox().bottom()/1000000000.0;
-		double maxLat = block.bbox().top()   /1000000000.0;
-		clippingBox = Box(geom::make<Point>(minLon, lat2latp(minLat)),
-			              geom::make<Point>(maxLon, lat2latp(maxLat)));
-	}
-	infile.close();
-	
-	// ----	Initialise Lua
-
-    lua_State *luaState = luaL_newstate();
-    luaL_openlibs(luaState);
-    luaL_dofile(luaState, luaFile.c_str());
-    luabind::open(luaState);
-	luabind::set_pcall_callback(&lua_error_handler);
-	luabind::module(luaState) [
-	luabind::class_<OSMObject>("OSM")
-		.def("Id", &OSMObject::Id)
-		.def("Holds", &OSMObject::Holds)
-		.def("Find", &OSMObject::Find)
-		.def("FindIntersecting", &OSMObject::FindIntersecting, luabind::return_stl_iterator)
-		.def("Intersects", &OSMObject::Intersects)
-		.def("IsClosed", &OSMObject::IsClosed)
-		.def("ScaleToMeter", &OSMObject::ScaleToMeter)
-		.def("ScaleToKiloMeter", &OSMObject::ScaleToKiloMeter)
-		.def("Area", &OSMObject::Area)
-		.def("Length", &OSMObject::Length)
-		.def("Layer", &OSMObject::Layer)
-		.def("LayerAsCentroid", &OSMObject::LayerAsCentroid)
-		.def("Attribute", &OSMObject::Attribute)
-		.def("AttributeNumeric", &OSMObject::AttributeNumeric)
-		.def("AttributeBoolean", &OSMObject::AttributeBoolean)
-	];
-	OSMObject osmObject(luaState, &indices, &cachedGeometries, &cachedGeometryNames, &osmStore);
-
-	// ----	Read JSON config
-
-	uint baseZoom, startZoom, endZoom;
-	string projectName, projectVersion, projectDesc;
-	bool includeID = false, compress = true, gzip = true;
-	string compressOpt;
-	rapidjson::Document jsonConfig;
-	double minLon, minLat, maxLon, maxLat;
-	try {
-		FILE* fp = fopen(jsonFile.c_str(), "r");
-		char readBuffer[65536];
-		rapidjson::FileReadStream is(fp, readBuffer, sizeof(readBuffer));
-		jsonConfig.ParseStream(is);
-		if (jsonConfig.HasParseError()) { cerr << "Invalid JSON file." << endl; return -1; }
-		fclose(fp);
-
-		// Global config
-		baseZoom       = jsonConfig["settings"]["basezoom"].GetUint();
-		startZoom      = jsonConfig["settings"]["minzoom" ].GetUint();
-		endZoom        = jsonConfig["settings"]["maxzoom" ].GetUint();
-		includeID      = jsonConfig["settings"]["include_ids"].GetBool();
-		if (! jsonConfig["settings"]["compress"].IsString()) {
-			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
-			return -1;
-		}
-		compressOpt    = jsonConfig["settings"]["compress"].GetString();
-		projectName    = jsonConfig["settings"]["name"].GetString();
-		projectVersion = jsonConfig["settings"]["version"].GetString();
-		projectDesc    = jsonConfig["settings"]["description"].GetString();
-		if (jsonConfig["settings"].HasMember("bounding_box")) {
-			hasClippingBox = true; clippingBoxFromJSON = true;
-			minLon = jsonConfig["settings"]["bounding_box"][0].GetDouble();
-			minLat = jsonConfig["settings"]["bounding_box"][1].GetDouble();
-			maxLon = jsonConfig["settings"]["bounding_box"][2].GetDouble();
-			maxLat = jsonConfig["settings"]["bounding_box"][3].GetDouble();
-			clippingBox = Box(geom::make<Point>(minLon, lat2latp(minLat)),
-				              geom::make<Point>(maxLon, lat2latp(maxLat)));
+	// ----	Render (again each time the Lua or JSON files change, in watch mode)
+	// (everything is rebuilt on each run, except for the .pbf blocks kept in blockCaches)
+
+	map<string, BlockCache> blockCaches;
+	auto render = [&]() -> int {
+
+		// ----	Initialise data collections
+
+		OSMStore osmStore;									// global OSM store
+		NodeStore &nodes = osmStore.nodes;
+		WayStore &ways = osmStore.ways;
+		RelationStore &relations = osmStore.relations;
+
+		map<string, RTree> indices;						// boost::geometry::index objects for shapefile indices
+		vector<Geometry> cachedGeometries;					// prepared boost::geometry objects (from shapefiles)
+		map<uint, string> cachedGeometryNames;			//  | optional names for each one
+
+		map< TileKey, vector<OutputObject> > tileIndex;			// objects to be output
+		map< WayID, vector<OutputObject> > relationOutputObjects;	// outputObjects for multipolygons (saved for processing later as ways)
+		map< WayID, vector<WayID> > wayRelations;					// for each way, which relations it's in (therefore we need to keep them)
+		IngestFilter ingestFilter;									// skips data outside the bounding box (if set) while reading
+		vector<PendingShapefile> pendingShapefiles;					// shapefile layers being read in the background
+		UpdateState updateState(osmStore, relationOutputObjects, wayRelations);	// what's needed to apply .osc changes later
+		updateState.recording = !saveSnapshot.empty();
+
+		// ----	Read bounding box from first .pbf (or the snapshot we're updating, or the saved index)
+
+		Box clippingBox;
+		bool hasClippingBox = false;
+		bool clippingBoxFromJSON = false;
+		TileIndexFile indexFile;
+		if (loadingIndex) {
+			cout << "Loading index " << loadIndex << endl;
+			try {
+				indexFile.open(loadIndex, osmStore, cachedGeometries, cachedGeometryNames);
+			} catch (exception &e) { cerr << e.what() << endl; return -1; }
+			hasClippingBox = indexFile.hasClippingBox;
+			clippingBox = indexFile.clippingBox;
+		} else if (updating) {
+			cout << "Loading snapshot " << loadSnapshot << endl;
+			try {
+				updateState.load(loadSnapshot);
+			} catch (exception &e) { cerr << e.what() << endl; return -1; }
+			hasClippingBox = updateState.hasClippingBox;
+			clippingBox = updateState.clippingBox;
+		} else {
+			fstream infile(inputFiles[0], ios::in | ios::binary);
+			if (!infile) { cerr << "Couldn't open .pbf file " << inputFiles[0] << endl; return -1; }
+			HeaderBlock block;
+			readBlock(&block, &infile);
+			if (block.has_bbox()) {
+				hasClippingBox = true;
+				double minLon = block.bbox().left()  /1000000000.0;
+				double maxLon = block.bbox().right() /1000000000.0;
+				double minLat = block.bbox().bottom()/1000000000.0;
+				double maxLat = block.bbox().top()   /1000000000.0;
+				clippingBox = Box(geom::make<Point>(minLon, lat2latp(minLat)),
+					              geom::make<Point>(maxLon, lat2latp(maxLat)));
+			}
+			infile.close();
 		}
-
-		// Check config is valid
-		if (endZoom > baseZoom) { cerr << "maxzoom must be the same or smaller than basezoom." << endl; return -1; }
-		if (! compressOpt.empty()) {
-			if      (compressOpt == "gzip"   ) { gzip = true;  }
-			else if (compressOpt == "deflate") { gzip = false; }
-			else if (compressOpt == "none"   ) { compress = false; }
-			else {
+	
+		// ----	Initialise Lua
+
+	    lua_State *luaState = luaL_newstate();
+		unique_ptr<lua_State, void(*)(lua_State*)> luaStateOwner(luaState, lua_close);	// (closed however we leave)
+	    luaL_openlibs(luaState);
+	    luaL_dofile(luaState, luaFile.c_str());
+	    luabind::open(luaState);
+		luabind::set_pcall_callback(&lua_error_handler);
+		luabind::module(luaState) [
+		luabind::class_<OSMObject>("OSM")
+			.def("Id", &OSMObject::Id)
+			.def("Holds", &OSMObject::Holds)
+			.def("Find", &OSMObject::Find)
+			.def("FindIntersecting", &OSMObject::FindIntersecting, luabind::return_stl_iterator)
+			.def("Intersects", &OSMObject::Intersects)
+			.def("IsClosed", &OSMObject::IsClosed)
+			.def("ScaleToMeter", &OSMObject::ScaleToMeter)
+			.def("ScaleToKiloMeter", &OSMObject::ScaleToKiloMeter)
+			.def("Area", &OSMObject::Area)
+			.def("Length", &OSMObject::Length)
+			.def("Layer", &OSMObject::Layer)
+			.def("LayerAsCentroid", &OSMObject::LayerAsCentroid)
+			.def("Attribute", &OSMObject::Attribute)
+			.def("AttributeNumeric", &OSMObject::AttributeNumeric)
+			.def("AttributeInteger", &OSMObject::AttributeInteger)
+			.def("AttributeBoolean", &OSMObject::AttributeBoolean)
+			.def("Priority", &OSMObject::Priority)
+		];
+		OSMObject osmObject(luaState, &indices, &cachedGeometries, &cachedGeometryNames, &osmStore);
+		osmObject.newWayID = updateState.newWayID;
+
+		// ----	Read JSON config
+
+		uint baseZoom, startZoom, endZoom;
+		string projectName, projectVersion, projectDesc;
+		bool includeID = false, compress = true, gzip = true, deduplicate = false;
+		uint maxTileBytes = 0, maxTileFeatures = 0;
+		string compressOpt;
+		vector<int> compressLevels, compressStrategies;		// per zoom level (the last applies to higher zooms)
+		string tileOrderOpt = "morton";
+		TileOrder tileOrder = ORDER_MORTON;
+		rapidjson::Document jsonConfig;
+		double minLon, minLat, maxLon, maxLat;
+		try {
+			FILE* fp = fopen(jsonFile.c_str(), "r");
+			char readBuffer[65536];
+			rapidjson::FileReadStream is(fp, readBuffer, sizeof(readBuffer));
+			jsonConfig.ParseStream(is);
+			if (jsonConfig.HasParseError()) { cerr << "Invalid JSON file." << endl; return -1; }
+			fclose(fp);
+
+			// Global config
+			baseZoom       = jsonConfig["settings"]["basezoom"].GetUint();
+			startZoom      = jsonConfig["settings"]["minzoom" ].GetUint();
+			endZoom        = jsonConfig["settings"]["maxzoom" ].GetUint();
+			includeID      = jsonConfig["settings"]["include_ids"].GetBool();
+			if (! jsonConfig["settings"]["compress"].IsString()) {
 				cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
 				return -1;
 			}
-		}
+			compressOpt    = jsonConfig["settings"]["compress"].GetString();
+			projectName    = jsonConfig["settings"]["name"].GetString();
+			projectVersion = jsonConfig["settings"]["version"].GetString();
+			projectDesc    = jsonConfig["settings"]["description"].GetString();
+			if (jsonConfig["settings"].HasMember("tile_order")) { tileOrderOpt = jsonConfig["settings"]["tile_order"].GetString(); }
+			if (jsonConfig["settings"].HasMember("deduplicate")) { deduplicate = jsonConfig["settings"]["deduplicate"].GetBool(); }
+			if (jsonConfig["settings"].HasMember("auto_integer")) { osmObject.autoInteger = jsonConfig["settings"]["auto_integer"].GetBool(); }
+			if (jsonConfig["settings"].HasMember("max_tile_bytes"   )) { maxTileBytes    = jsonConfig["settings"]["max_tile_bytes"   ].GetUint(); }
+			if (jsonConfig["settings"].HasMember("max_tile_features")) { maxTileFeatures = jsonConfig["settings"]["max_tile_features"].GetUint(); }
+			if (jsonConfig["settings"].HasMember("bounding_box")) {
+				hasClippingBox = true; clippingBoxFromJSON = true;
+				minLon = jsonConfig["settings"]["bounding_box"][0].GetDouble();
+				minLat = jsonConfig["settings"]["bounding_box"][1].GetDouble();
+				maxLon = jsonConfig["settings"]["bounding_box"][2].GetDouble();
+				maxLat = jsonConfig["settings"]["bounding_box"][3].GetDouble();
+				clippingBox = Box(geom::make<Point>(minLon, lat2latp(minLat)),
+					              geom::make<Point>(maxLon, lat2latp(maxLat)));
+				double margin = jsonConfig["settings"].HasMember("bounding_box_margin") ? jsonConfig["settings"]["bounding_box_margin"].GetDouble() : 0.05;
+				ingestFilter.setBox(minLon, minLat, maxLon, maxLat, margin);
+			}
 
-		// Layers
-		rapidjson::Value& layerHash = jsonConfig["layers"];
-		for (rapidjson::Value::MemberIterator it = layerHash.MemberBegin(); it != layerHash.MemberEnd(); ++it) {
-
-			// Basic layer settings
-			string layerName = it->name.GetString();
-			int minZoom = it->value["minzoom"].GetInt();
-			int maxZoom = it->value["maxzoom"].GetInt();
-			string writeTo = it->value.HasMember("write_to") ? it->value["write_to"].GetString() : "";
-			int   simplifyBelow = it->value.HasMember("simplify_below") ? it->value["simplify_below"].GetInt()    : 0;
-			double simplifyLevel = it->value.HasMember("simplify_level") ? it->value["simplify_level"].GetDouble() : 0.01;
-			double simplifyLength = it->value.HasMember("simplify_length") ? it->value["simplify_length"].GetDouble() : 0.0;
-			double simplifyRatio = it->value.HasMember("simplify_ratio") ? it->value["simplify_ratio"].GetDouble() : 1.0;
-			uint layerNum = osmObject.addLayer(layerName, minZoom, maxZoom,
-					simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, writeTo);
-			cout << "Layer " << layerName << " (z" << minZoom << "-" << maxZoom << ")";
-			if (it->value.HasMember("write_to")) { cout << " -> " << it->value["write_to"].GetString(); }
-			cout << endl;
+			// Check config is valid
+			if (endZoom > baseZoom) { cerr << "maxzoom must be the same or smaller than basezoom." << endl; return -1; }
+			if (baseZoom > 30) { cerr << "basezoom can't be higher than 30." << endl; return -1; }
+			if (loadingIndex && baseZoom != indexFile.baseZoom) { cerr << "basezoom must be the same as when the index was saved (" << indexFile.baseZoom << ")." << endl; return -1; }
+			shard.baseZoom = baseZoom; shard.startZoom = startZoom; shard.endZoom = endZoom;
+			if      (tileOrderOpt == "morton" ) { tileOrder = ORDER_MORTON; }
+			else if (tileOrderOpt == "hilbert") { tileOrder = ORDER_HILBERT; }
+			else if (tileOrderOpt == "columns") { tileOrder = ORDER_COLUMNS; }
+			else { cerr << "\"tile_order\" should be any of \"morton\",\"hilbert\",\"columns\" in JSON file." << endl; return -1; }
+			if (! compressOpt.empty()) {
+				if      (compressOpt == "gzip"   ) { gzip = true;  }
+				else if (compressOpt == "deflate") { gzip = false; }
+				else if (compressOpt == "none"   ) { compress = false; }
+				else {
+					cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
+					return -1;
+				}
+			}
+			// Compression level and strategy: one value, or a list with one for each zoom level from 0
+			if (jsonConfig["settings"].HasMember("compress_level")) {
+				const rapidjson::Value &v = jsonConfig["settings"]["compress_level"];
+				if (v.IsArray()) { for (uint i=0; i<v.Size(); i++) { compressLevels.push_back(v[i].GetInt()); } }
+				else { compressLevels.push_back(v.GetInt()); }
+				for (int level : compressLevels) {
+					if (level < -1 || level > 9) { cerr << "\"compress_level\" should be from 0 to 9 (or -1 for zlib's default) in JSON file." << endl; return -1; }
+				}
+			}
+			if (jsonConfig["settings"].HasMember("compress_strategy")) {
+				const rapidjson::Value &v = jsonConfig["settings"]["compress_strategy"];
+				vector<string> names;
+				if (v.IsArray()) { for (uint i=0; i<v.Size(); i++) { names.push_back(v[i].GetString()); } }
+				else { names.push_back(v.GetString()); }
+				for (auto &name : names) {
+					if      (name == "default" ) { compressStrategies.push_back(Z_DEFAULT_STRATEGY); }
+					else if (name == "filtered") { compressStrategies.push_back(Z_FILTERED); }
+					else if (name == "huffman" ) { compressStrategies.push_back(Z_HUFFMAN_ONLY); }
+					else if (name == "rle"     ) { compressStrategies.push_back(Z_RLE); }
+					else if (name == "fixed"   ) { compressStrategies.push_back(Z_FIXED); }
+					else { cerr << "\"compress_strategy\" should be any of \"default\",\"filtered\",\"huffman\",\"rle\",\"fixed\" in JSON file." << endl; return -1; }
+				}
+			}
 
-			// External layer sources
-			if (it->value.HasMember("source")) {
-				if (!hasClippingBox) {
-					cerr << "Can't read shapefiles unless a bounding box is provided." << endl;
-					return EXIT_FAILURE;
+			// Layers
+			rapidjson::Value& layerHash = jsonConfig["layers"];
+			for (rapidjson::Value::MemberIterator it = layerHash.MemberBegin(); it != layerHash.MemberEnd(); ++it) {
+
+				// Basic layer settings
+				string layerName = it->name.GetString();
+				int minZoom = it->value["minzoom"].GetInt();
+				int maxZoom = it->value["maxzoom"].GetInt();
+				string writeTo = it->value.HasMember("write_to") ? it->value["write_to"].GetString() : "";
+				LayerDef layer;
+				layer.name = layerName;
+				layer.minzoom = minZoom;
+				layer.maxzoom = maxZoom;
+				layer.simplifyBelow   = it->value.HasMember("simplify_below")    ? it->value["simplify_below"].GetInt()       : 0;
+				layer.simplifyLevel   = it->value.HasMember("simplify_level")    ? it->value["simplify_level"].GetDouble()    : 0.01;
+				layer.simplifyLength  = it->value.HasMember("simplify_length")   ? it->value["simplify_length"].GetDouble()   : 0.0;
+				layer.simplifyRatio   = it->value.HasMember("simplify_ratio")    ? it->value["simplify_ratio"].GetDouble()    : 1.0;
+				layer.minAreaPixels   = it->value.HasMember("min_area_pixels")   ? it->value["min_area_pixels"].GetDouble()   : 0.0;
+				layer.minLengthPixels = it->value.HasMember("min_length_pixels") ? it->value["min_length_pixels"].GetDouble() : 0.0;
+				layer.thinPoints      = THIN_NONE;
+				if (it->value.HasMember("thin_points")) {
+					string thinning = it->value["thin_points"].GetString();
+					if      (thinning == "grid"    ) { layer.thinPoints = THIN_GRID; }
+					else if (thinning == "priority") { layer.thinPoints = THIN_PRIORITY; }
+					else { cerr << "\"thin_points\" should be \"grid\" or \"priority\" in JSON file." << endl; return -1; }
 				}
-				vector<string> sourceColumns;
-				if (it->value.HasMember("source_columns")) {
-					for (uint i=0; i<it->value["source_columns"].Size(); i++) {
-						sourceColumns.push_back(it->value["source_columns"][i].GetString());
+				layer.thinPointsCell  = it->value.HasMember("thin_points_cell")  ? it->value["thin_points_cell"].GetDouble()  : 16.0;
+				layer.clusterCount    = it->value.HasMember("cluster_count")     ? it->value["cluster_count"].GetString()     : "";
+				uint layerNum = osmObject.addLayer(layer, writeTo);
+				cout << "Layer " << layerName << " (z" << minZoom << "-" << maxZoom << ")";
+				if (it->value.HasMember("write_to")) { cout << " -> " << it->value["write_to"].GetString(); }
+				cout << endl;
+
+				// External layer sources
+				// (already in the index, if we're loading one)
+				if (it->value.HasMember("source") && !loadingIndex) {
+					if (!hasClippingBox) {
+						cerr << "Can't read shapefiles unless a bounding box is provided." << endl;
+						return EXIT_FAILURE;
+					}
+					vector<string> sourceColumns;
+					if (it->value.HasMember("source_columns")) {
+						for (uint i=0; i<it->value["source_columns"].Size(); i++) {
+							sourceColumns.push_back(it->value["source_columns"][i].GetString());
+						}
 					}
+					uint indexCapacity = it->value.HasMember("index_node_capacity") ? max(it->value["index_node_capacity"].GetUint(), 4u) : 16;
+					bool indexed=false; if (it->value.HasMember("index")) {
+						indexed=it->value["index"].GetBool();
+						indices.emplace(layerName, RTree(geom::index::dynamic_quadratic(indexCapacity)));
+					}
+					string indexName = it->value.HasMember("index_column") ? it->value["index_column"].GetString() : "";
+					string source = it->value["source"].GetString();
+					pendingShapefiles.push_back(PendingShapefile { layerName, indexed, indexCapacity,
+						async(launch::async, readShapefileCached, shapefileCache, ends_with(source, ".fgb") ? readFlatGeobuf : readShapefile,
+						      source, sourceColumns, clippingBox,
+						      baseZoom, layerNum, indexed, indexName) });
 				}
-				bool indexed=false; if (it->value.HasMember("index")) {
-					indexed=it->value["index"].GetBool();
-					indices[layerName]=RTree();
+			}
+		} catch (...) {
+			cerr << "Couldn't find expected details in JSON file." << endl;
+			return -1;
+		}
+
+		// Merge shapefile layers as they finish (indexed ones now, as Lua may query them;
+		// the rest once the .pbf has been read)
+		auto mergeShapefiles = [&](bool indexed) -> bool {
+			for (auto &pending : pendingShapefiles) {
+				if (pending.indexed != indexed || !pending.result.valid()) { continue; }
+				try {
+					ShapefileLayer layer = pending.result.get();
+					mergeShapefileLayer(layer, tileIndex, cachedGeometries, cachedGeometryNames,
+					                    indexed ? &indices.at(pending.layerName) : nullptr, pending.indexCapacity);
+				} catch (exception &e) {
+					cerr << "Couldn't read shapefile for layer " << pending.layerName << ": " << e.what() << endl;
+					return false;
 				}
-				string indexName = it->value.HasMember("index_column") ? it->value["index_column"].GetString() : "";
-				readShapefile(it->value["source"].GetString(), sourceColumns, clippingBox, tileIndex,
-				              cachedGeometries, cachedGeometryNames, baseZoom, layerNum, layerName, indexed, indices, indexName);
+			}
+			return true;
+		};
+		if (!mergeShapefiles(true)) { return -1; }
+
+		// ---- Call init_function of Lua logic
+		lua_getglobal(luaState, "init_function");
+		int exists_init_function = !lua_isnil(luaState, -1);
+		lua_pop(luaState, 1);
+		if (exists_init_function) {
+			try { luabind::call_function<int>(luaState, "init_function");
+			} catch (const luabind::error &er) {
+				cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+				return -1;
 			}
 		}
-	} catch (...) {
-		cerr << "Couldn't find expected details in JSON file." << endl;
-		return -1;
-	}
 
-	// ---- Call init_function of Lua logic
-	lua_getglobal(luaState, "init_function");
-	int exists_init_function = !lua_isnil(luaState, -1);
-	lua_pop(luaState, 1);
-	if (exists_init_function) {
-		try { luabind::call_function<int>(luaState, "init_function");
-		} catch (const luabind::error &er) {
-			cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+		// ----	Read significant node tags
+
+		unordered_set<string> nodeKeys;
+		lua_getglobal( luaState, "node_keys");
+		if (lua_isnil(luaState,-1)) {
+			cerr << "Error found in Lua script when reading node_keys - check your script for syntax errors." << endl;
 			return -1;
 		}
-	}
-
-	// ----	Read significant node tags
+		lua_pushnil( luaState );
+		while(lua_next( luaState, -2) != 0) {
+			string key = lua_tostring( luaState, -1 );
+			lua_pop( luaState, 1);
+			nodeKeys.insert(key);
+		}
 
-	unordered_set<string> nodeKeys;
-	lua_getglobal( luaState, "node_keys");
-	if (lua_isnil(luaState,-1)) {
-		cerr << "Error found in Lua script when reading node_keys - check your script for syntax errors." << endl;
-		return -1;
-	}
-	lua_pushnil( luaState );
-	while(lua_next( luaState, -2) != 0) {
-		string key = lua_tostring( luaState, -1 );
-		lua_pop( luaState, 1);
-		nodeKeys.insert(key);
-	}
+		// ----	Initialise mbtiles if required
+		// (when writing shards, each is a bulk-loaded file with its own writer thread, merged at the end)
+
+		vector<unique_ptr<MBTiles>> mbtiles;
+		if (sqlite) {
+			for (uint i=0; i<outputShards; i++) {
+				string filename = outputShards>1 ? MBTiles::shardFilename(outputFile, i) : outputFile;
+				if (outputShards>1) { boost::filesystem::remove(filename); }
+				mbtiles.emplace_back(new MBTiles());
+				MBTiles &mb = *mbtiles.back();
+				mb.open(&filename, deduplicate, bulkLoad || outputShards>1);
+				mb.vacuum = vacuum && outputShards==1;
+				mb.indexOnClose = outputShards==1;
+				if (changedOnly) { mb.readExistingTiles(); }
+				mb.writeMetadata("name",projectName);
+				mb.writeMetadata("type","baselayer");
+				mb.writeMetadata("version",projectVersion);
+				mb.writeMetadata("description",projectDesc);
+				mb.writeMetadata("format","pbf");
+				if (jsonConfig["settings"].HasMember("metadata")) {
+					const rapidjson::Value &md = jsonConfig["settings"]["metadata"];
+					for(rapidjson::Value::ConstMemberIterator it=md.MemberBegin(); it != md.MemberEnd(); ++it) {
+						if (it->value.IsString()) {
+							mb.writeMetadata(it->name.GetString(), it->value.GetString());
+						} else {
+							rapidjson::StringBuffer strbuf;
+							rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+							it->value.Accept(writer);
+							mb.writeMetadata(it->name.GetString(), strbuf.GetString());
+						}
+					}
+				}
+			}
+		}
 
-	// ----	Initialise mbtiles if required
-	
-	MBTiles mbtiles;
-	if (sqlite) {
-		mbtiles.open(&outputFile);
-		mbtiles.writeMetadata("name",projectName);
-		mbtiles.writeMetadata("type","baselayer");
-		mbtiles.writeMetadata("version",projectVersion);
-		mbtiles.writeMetadata("description",projectDesc);
-		mbtiles.writeMetadata("format","pbf");
-		if (jsonConfig["settings"].HasMember("metadata")) {
-			const rapidjson::Value &md = jsonConfig["settings"]["metadata"];
-			for(rapidjson::Value::ConstMemberIterator it=md.MemberBegin(); it != md.MemberEnd(); ++it) {
-				if (it->value.IsString()) {
-					mbtiles.writeMetadata(it->name.GetString(), it->value.GetString());
-				} else {
+		// ----	Initialise .pmtiles if required
+
+		PMTiles archive;
+		if (pmtiles) {
+			archive.open(outputFile);
+			archive.tileCompression = !compress ? PMTilesHeader::COMPRESSION_NONE :
+			                          gzip      ? PMTilesHeader::COMPRESSION_GZIP : PMTilesHeader::COMPRESSION_UNKNOWN;
+			archive.writeMetadata("name",projectName);
+			archive.writeMetadata("type","baselayer");
+			archive.writeMetadata("version",projectVersion);
+			archive.writeMetadata("description",projectDesc);
+			archive.writeMetadata("format","pbf");
+			if (jsonConfig["settings"].HasMember("metadata")) {
+				const rapidjson::Value &md = jsonConfig["settings"]["metadata"];
+				for(rapidjson::Value::ConstMemberIterator it=md.MemberBegin(); it != md.MemberEnd(); ++it) {
 					rapidjson::StringBuffer strbuf;
 					rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
 					it->value.Accept(writer);
-					mbtiles.writeMetadata(it->name.GetString(), strbuf.GetString());
+					archive.writeMetadataJSON(it->name.GetString(), strbuf.GetString());
 				}
 			}
 		}
-	}
 
-	// ----	Read all PBFs
+		// ----	Read all PBFs
 	
-	for (auto inputFile : inputFiles) {
+		for (auto inputFile : inputFiles) {
 	
-		// ----	Read PBF
-		// note that the order of reading and processing is:
-		//  1) output nodes -> (remember current position for rewinding to ways) (skip ways) -> (just remember all ways in any relation),
-		//  2) (for the remembered ways, construct nodeId lists) -> output relations, though the actual output task is delayed until each way's processing
-		//  3) output ways, with every relation which contains the way
-
-		cout << "Reading " << inputFile << endl;
-
-		fstream infile(inputFile, ios::in | ios::binary);
-		if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
-		HeaderBlock block;
-		readBlock(&block, &infile);
-
-		PrimitiveBlock pb;
-		PrimitiveGroup pg;
-		DenseNodes dense;
-		Way pbfWay;
-		vector<string> strings(0);
-		uint i,j,k,ct=0;
-		int64_t nodeId;
-		bool checkedRelations = false;
-		bool processedRelations = false;
-		int wayPosition = -1;
-		unordered_set<WayID> waysInRelation;
-
-		while (true) {
-			int blockStart = infile.tellg();
-			readBlock(&pb, &infile);
-			if (infile.eof()) {
-				if (!checkedRelations) {
-					checkedRelations = true;
-				} else if (!processedRelations) {
-					processedRelations = true;
-					// NodeId lists for ways were constructed to process relations. Then reset it, because relations processing have ended.
-					ways.clear();
-				} else {
-					break;
+			// ----	Read PBF
+			// note that the order of reading and processing is:
+			//  1) output nodes -> (remember current position for rewinding to ways) (skip ways) -> (just remember all ways in any relation),
+			//  2) (for the remembered ways, construct nodeId lists) -> output relations, though the actual output task is delayed until each way's processing
+			//  3) output ways, with every relation which contains the way
+
+			cout << "Reading " << inputFile << endl;
+
+			fstream infile(inputFile, ios::in | ios::binary);
+			if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
+			HeaderBlock block;
+			readBlock(&block, &infile);
+
+			PrimitiveBlock pb;
+			PrimitiveGroup pg;
+			DenseNodes dense;
+			Way pbfWay;
+			vector<string> strings(0);
+			uint i,j,k,ct=0;
+			int64_t nodeId;
+			bool checkedRelations = false;
+			bool processedRelations = false;
+			int wayPosition = -1;
+			unordered_set<WayID> waysInRelation;
+
+			while (true) {
+				int blockStart = infile.tellg();
+				readBlock(&pb, &infile, watch ? &blockCaches[inputFile] : nullptr);
+				if (infile.eof()) {
+					if (!checkedRelations) {
+						checkedRelations = true;
+						ingestFilter.scan(inputFile, wayPosition, nodes);
+					} else if (!processedRelations) {
+						processedRelations = true;
+						// NodeId lists for ways were constructed to process relations. Then reset it, because relations processing have ended.
+						ways.clear();
+					} else {
+						break;
+					}
+					infile.clear();
+					infile.seekg(wayPosition);
+					continue;
 				}
-				infile.clear();
-				infile.seekg(wayPosition);
-				continue;
-			}
 
-			// Read the string table, and pre-calculate the positions of valid node keys
-			osmObject.readStringTable(&pb);
-			unordered_set<int> nodeKeyPositions;
-			for (auto it : nodeKeys) {
-				nodeKeyPositions.insert(osmObject.findStringPosition(it));
-			}
+				// Read the string table, and pre-calculate the positions of valid node keys
+				osmObject.readStringTable(&pb);
+				unordered_set<int> nodeKeyPositions;
+				for (auto it : nodeKeys) {
+					nodeKeyPositions.insert(osmObject.findStringPosition(it));
+				}
 
-			for (i=0; i<pb.primitivegroup_size(); i++) {
-				pg = pb.primitivegroup(i);
-				cout << "Block " << ct << " group " << i << " ways " << pg.ways_size() << " relations " << pg.relations_size() << "        \r";
-				cout.flush();
-
-				// ----	Read nodes
-
-				if (pg.has_dense()) {
-					nodeId  = 0;
-					int lon = 0;
-					int lat = 0;
-					int kvPos = 0;
-					dense = pg.dense();
-					for (j=0; j<dense.id_size(); j++) {
-						nodeId += dense.id(j);
-						lon    += dense.lon(j);
-						lat    += dense.lat(j);
-						LatpLon node = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
-						nodes.insert_back(nodeId, node);
-						bool significant = false;
-						int kvStart = kvPos;
-						if (dense.keys_vals_size()>0) {
-							while (dense.keys_vals(kvPos)>0) {
-								if (nodeKeyPositions.find(dense.keys_vals(kvPos)) != nodeKeyPositions.end()) {
-									significant = true;
+				for (i=0; i<pb.primitivegroup_size(); i++) {
+					pg = pb.primitivegroup(i);
+					cout << "Block " << ct << " group " << i << " ways " << pg.ways_size() << " relations " << pg.relations_size() << "        \r";
+					cout.flush();
+
+					// ----	Read nodes
+
+					if (pg.has_dense()) {
+						nodeId  = 0;
+						int lon = 0;
+						int lat = 0;
+						int kvPos = 0;
+						dense = pg.dense();
+						for (j=0; j<dense.id_size(); j++) {
+							nodeId += dense.id(j);
+							lon    += dense.lon(j);
+							lat    += dense.lat(j);
+							LatpLon node = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
+							bool inBox = ingestFilter.includes(node);
+							if (inBox) { nodes.insert_back(nodeId, node); }
+							bool significant = false;
+							int kvStart = kvPos;
+							if (dense.keys_vals_size()>0) {
+								while (dense.keys_vals(kvPos)>0) {
+									if (nodeKeyPositions.find(dense.keys_vals(kvPos)) != nodeKeyPositions.end()) {
+										significant = true;
+									}
+									kvPos+=2;
 								}
-								kvPos+=2;
+								kvPos++;
 							}
-							kvPos++;
-						}
-						// For tagged nodes, call Lua, then save the OutputObject
-						if (significant) {
-							osmObject.setNode(nodeId, &dense, kvStart, kvPos-1, node);
-							try { luabind::call_function<int>(luaState, "node_function", &osmObject);
-							} catch (const luabind::error &er) {
-		    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
-								return -1;
-							}
-							if (!osmObject.empty()) {
-								uint32_t index = latpLon2index(node, baseZoom);
-								for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
-									tileIndex[index].push_back(*jt);
+							// For tagged nodes, call Lua, then save the OutputObject
+							if (significant && inBox && (!shardPrune || shard.includesBaseTile(latpLon2index(node, baseZoom)))) {
+								osmObject.setNode(nodeId, &dense, kvStart, kvPos-1, node);
+								try { luabind::call_function<int>(luaState, "node_function", &osmObject);
+								} catch (const luabind::error &er) {
+			    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+									return -1;
+								}
+								if (!osmObject.empty()) {
+									TileKey index = latpLon2index(node, baseZoom);
+									for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
+										tileIndex[index].push_back(*jt);
+									}
+									if (updateState.recording) { updateState.nodeOutputs[nodeId] = osmObject.outputs; }
 								}
 							}
 						}
+						continue;
 					}
-					continue;
-				}
-
-				// ----	Remember the position and skip ways
 
-				if (!checkedRelations && pg.ways_size() > 0) {
-					if (wayPosition == -1) {
-						wayPosition = blockStart;
-					}
-					continue;
-				}
+					// ----	Remember the position and skip ways
 
-				// ----	Remember all ways in any relation
-
-				if (!checkedRelations && pg.relations_size() > 0) {
-					for (j=0; j<pg.relations_size(); j++) {
-						Relation pbfRelation = pg.relations(j);
-						int64_t lastID = 0;
-						for (uint n = 0; n < pbfRelation.memids_size(); n++) {
-							lastID += pbfRelation.memids(n);
-							if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
-							WayID wayId = static_cast<WayID>(lastID);
-							waysInRelation.insert(wayId);
+					if (!checkedRelations && pg.ways_size() > 0) {
+						if (wayPosition == -1) {
+							wayPosition = blockStart;
 						}
+						continue;
 					}
-					continue;
-				}
-
-				if (!checkedRelations) {
-					// Nothing to do
-					break;
-				}
-
-				// ----	For the remembered ways, construct nodeId lists
-
-				if (!processedRelations && pg.ways_size() > 0) {
-					for (j=0; j<pg.ways_size(); j++) {
-						pbfWay = pg.ways(j);
-						WayID wayId = pbfWay.id();
-						if (waysInRelation.count(wayId) > 0) {
-							// Assemble nodelist
-							nodeId = 0;
-							NodeVec nodeVec;
-							for (k = 0; k < pbfWay.refs_size(); k++) {
-								nodeId += pbfWay.refs(k);
-								nodeVec.push_back(static_cast<NodeID>(nodeId));
-							}
-							ways.insert_back(wayId, nodeVec);
-						}
-					}
-					continue;
-				}
 
-				if (!processedRelations && !waysInRelation.empty()) {
-					// forget those ways here to save memory
-					waysInRelation.clear();
-				}
+					// ----	Remember all ways in any relation
 
-				// ----	Read relations
-				//		(just multipolygons for now; we should do routes in time)
-
-				if (!processedRelations && pg.relations_size() > 0) {
-					int typeKey = osmObject.findStringPosition("type");
-					int mpKey   = osmObject.findStringPosition("multipolygon");
-					int innerKey= osmObject.findStringPosition("inner");
-					//int outerKey= osmObject.findStringPosition("outer");
-					if (typeKey >-1 && mpKey>-1) {
+					if (!checkedRelations && pg.relations_size() > 0) {
 						for (j=0; j<pg.relations_size(); j++) {
 							Relation pbfRelation = pg.relations(j);
-							if (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) == pbfRelation.keys().end()) { continue; }
-							if (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) == pbfRelation.vals().end()) { continue; }
-
-							// Read relation members
-							WayVec outerWayVec, innerWayVec;
 							int64_t lastID = 0;
-							for (uint n=0; n < pbfRelation.memids_size(); n++) {
+							for (uint n = 0; n < pbfRelation.memids_size(); n++) {
 								lastID += pbfRelation.memids(n);
 								if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
-								int32_t role = pbfRelation.roles_sid(n);
-								// if (role != innerKey && role != outerKey) { continue; }
-								// ^^^^ commented out so that we don't die horribly when a relation has no outer way
 								WayID wayId = static_cast<WayID>(lastID);
-								(role == innerKey ? innerWayVec : outerWayVec).push_back(wayId);
+								waysInRelation.insert(wayId);
 							}
+						}
+						continue;
+					}
 
-							osmObject.setRelation(&pbfRelation, &outerWayVec, &innerWayVec);
-							// Check with Lua if we want it
-							try { luabind::call_function<int>(luaState, "way_function", &osmObject);
-							} catch (const luabind::error &er) {
-		    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
-								return -1;
+					if (!checkedRelations) {
+						// Nothing to do
+						break;
+					}
+
+					// ----	For the remembered ways, construct nodeId lists
+
+					if (!processedRelations && pg.ways_size() > 0) {
+						for (j=0; j<pg.ways_size(); j++) {
+							pbfWay = pg.ways(j);
+							WayID wayId = pbfWay.id();
+							if (waysInRelation.count(wayId) > 0 && ingestFilter.includesWay(wayId)) {
+								// Assemble nodelist
+								nodeId = 0;
+								NodeVec nodeVec;
+								for (k = 0; k < pbfWay.refs_size(); k++) {
+									nodeId += pbfWay.refs(k);
+									nodeVec.push_back(static_cast<NodeID>(nodeId));
+								}
+								ways.insert_back(wayId, nodeVec);
 							}
-							if (!osmObject.empty()) {
-								WayID relID = osmObject.osmID;
-								// Store the relation members in the global relation store
-								relations.insert_front(relID, outerWayVec, innerWayVec);
-								// Store this relation in the way->relations map to oblige each way in the relation
-                                // to output it, even if the way is not rendered in its own right.
-								for (auto it = outerWayVec.cbegin(); it != outerWayVec.cend(); ++it) {
-									wayRelations[*it].push_back(relID);
- 								}
-								for (auto it = innerWayVec.cbegin(); it != innerWayVec.cend(); ++it) {
-									wayRelations[*it].push_back(relID);
+						}
+						continue;
+					}
+
+					if (!processedRelations && !waysInRelation.empty()) {
+						// forget those ways here to save memory
+						waysInRelation.clear();
+					}
+
+					// ----	Read relations
+					//		(just multipolygons for now; we should do routes in time)
+
+					if (!processedRelations && pg.relations_size() > 0) {
+						int typeKey = osmObject.findStringPosition("type");
+						int mpKey   = osmObject.findStringPosition("multipolygon");
+						int innerKey= osmObject.findStringPosition("inner");
+						//int outerKey= osmObject.findStringPosition("outer");
+						if (typeKey >-1 && mpKey>-1) {
+							for (j=0; j<pg.relations_size(); j++) {
+								Relation pbfRelation = pg.relations(j);
+								if (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) == pbfRelation.keys().end()) { continue; }
+								if (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) == pbfRelation.vals().end()) { continue; }
+
+								// Read relation members
+								WayVec outerWayVec, innerWayVec;
+								int64_t lastID = 0;
+								for (uint n=0; n < pbfRelation.memids_size(); n++) {
+									lastID += pbfRelation.memids(n);
+									if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
+									int32_t role = pbfRelation.roles_sid(n);
+									// if (role != innerKey && role != outerKey) { continue; }
+									// ^^^^ commented out so that we don't die horribly when a relation has no outer way
+									WayID wayId = static_cast<WayID>(lastID);
+									(role == innerKey ? innerWayVec : outerWayVec).push_back(wayId);
 								}
-								// Keep output objects
-								for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
-									relationOutputObjects[relID].push_back(*jt);
+								if (!ingestFilter.includesRelation(outerWayVec, innerWayVec)) { continue; }
+
+								osmObject.setRelation(&pbfRelation, &outerWayVec, &innerWayVec);
+								// Check with Lua if we want it
+								try { luabind::call_function<int>(luaState, "way_function", &osmObject);
+								} catch (const luabind::error &er) {
+			    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+									return -1;
+								}
+								if (!osmObject.empty()) {
+									WayID relID = osmObject.osmID;
+									if (updateState.recording) { updateState.relationIDs[pbfRelation.id()] = relID; }
+									// Store the relation members in the global relation store
+									relations.insert_front(relID, outerWayVec, innerWayVec);
+									// Store this relation in the way->relations map to oblige each way in the relation
+	                                // to output it, even if the way is not rendered in its own right.
+									for (auto it = outerWayVec.cbegin(); it != outerWayVec.cend(); ++it) {
+										wayRelations[*it].push_back(relID);
+	 								}
+									for (auto it = innerWayVec.cbegin(); it != innerWayVec.cend(); ++it) {
+										wayRelations[*it].push_back(relID);
+									}
+									// Keep output objects
+									for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
+										relationOutputObjects[relID].push_back(*jt);
+									}
 								}
 							}
 						}
+						continue;
 					}
-					continue;
-				}
 
-				if (!processedRelations) {
-					// Nothing to do
-					break;
-				}
-
-				// ----	Read ways
+					if (!processedRelations) {
+						// Nothing to do
+						break;
+					}
 
-				if (pg.ways_size() > 0) {
-					for (j=0; j<pg.ways_size(); j++) {
-						pbfWay = pg.ways(j);
-						WayID wayId = static_cast<WayID>(pbfWay.id());
+					// ----	Read ways
 
-						// Assemble nodelist
-						nodeId = 0;
-						NodeVec nodeVec;
-						for (k=0; k<pbfWay.refs_size(); k++) {
-							nodeId += pbfWay.refs(k);
-							nodeVec.push_back(static_cast<NodeID>(nodeId));
-						}
+					if (pg.ways_size() > 0) {
+						for (j=0; j<pg.ways_size(); j++) {
+							pbfWay = pg.ways(j);
+							WayID wayId = static_cast<WayID>(pbfWay.id());
+							if (!ingestFilter.includesWay(wayId)) { continue; }
 
-						osmObject.setWay(&pbfWay, &nodeVec);
-						// Call Lua to find what layers and tags we want
-						try { luabind::call_function<int>(luaState, "way_function", &osmObject);
-						} catch (const luabind::error &er) {
-	    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
-							return -1;
-						}
+							// Assemble nodelist
+							nodeId = 0;
+							NodeVec nodeVec;
+							for (k=0; k<pbfWay.refs_size(); k++) {
+								nodeId += pbfWay.refs(k);
+								nodeVec.push_back(static_cast<NodeID>(nodeId));
+							}
 
-						bool inRelation = wayRelations.count(pbfWay.id()) > 0;
-						if (!osmObject.empty() || inRelation) {
-							// Store the way's nodes in the global way store
-							ways.insert_back(wayId, nodeVec);
+							osmObject.setWay(&pbfWay, &nodeVec);
+							// Call Lua to find what layers and tags we want
+							try { luabind::call_function<int>(luaState, "way_function", &osmObject);
+							} catch (const luabind::error &er) {
+		    					cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+								return -1;
+							}
 
-							// create a list of tiles this way passes through (tilelist)
-							unordered_set <uint32_t> tilelist;
-							uint lastX, lastY;
-							for (k=0; k<pbfWay.refs_size(); k++) {
-								uint tileX =  lon2tilex(nodes.at(nodeVec[k]).lon  / 10000000.0, baseZoom);
-								uint tileY = latp2tiley(nodes.at(nodeVec[k]).latp / 10000000.0, baseZoom);
-								if (k>0) {
-									// Check we're not skipping any tiles, and insert intermediate nodes if so
-									// (we should have a simple fill algorithm for polygons, too)
-									int dx = abs((int)tileX-(int)lastX);
-									int dy = abs((int)tileY-(int)lastY);
-									if (dx>1 || dy>1 || (dx==1 && dy==1)) {
-										insertIntermediateTiles(&tilelist, max(dx,dy), nodes.at(nodeVec[k-1]), nodes.at(nodeVec[k]), baseZoom);
+							bool inRelation = wayRelations.count(pbfWay.id()) > 0;
+							if (!osmObject.empty() || inRelation) {
+								// create a list of tiles this way passes through (tilelist)
+								unordered_set <TileKey> tilelist = osmStore.nodeListTiles(nodeVec, baseZoom);
+								if (shardPrune) {
+									for (auto it = tilelist.begin(); it != tilelist.end(); ) {
+										if (shard.includesBaseTile(*it)) { ++it; } else { it = tilelist.erase(it); }
 									}
 								}
-								uint32_t index = tileX * 65536 + tileY;
-								tilelist.insert( index );
-								lastX = tileX;
-								lastY = tileY;
-							}
 
-							// then, for each tile, store the OutputObject for each layer
-							for (auto it = tilelist.begin(); it != tilelist.end(); ++it) {
-								uint32_t index = *it;
-								for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
-									tileIndex[index].push_back(*jt);
+								// Store the way's nodes in the global way store
+								// (unless it's wholly outside this shard)
+								if (!tilelist.empty() || inRelation || !shardPrune) {
+									ways.insert_back(wayId, nodeVec);
+									if (updateState.recording && !osmObject.empty()) { updateState.wayOutputs[wayId] = osmObject.outputs; }
 								}
-							}
 
-							// if it's in any relations to be output, do the same for each relation
-							if (inRelation) {
-								for (auto wt = wayRelations[wayId].begin(); wt != wayRelations[wayId].end(); ++wt) {
-									WayID relID = *wt;
-									// relID is now the relation ID
-									for (auto it = tilelist.begin(); it != tilelist.end(); ++it) {
-										// index is now the tile index number
-										uint32_t index = *it;
-										// add all the OutputObjects for this relation into this tile
-										for (auto jt = relationOutputObjects[relID].begin(); jt != relationOutputObjects[relID].end(); ++jt) {
-											tileIndex[index].push_back(*jt);
+								// then, for each tile, store the OutputObject for each layer
+								for (auto it = tilelist.begin(); it != tilelist.end(); ++it) {
+									TileKey index = *it;
+									for (auto jt = osmObject.outputs.begin(); jt != osmObject.outputs.end(); ++jt) {
+										tileIndex[index].push_back(*jt);
+									}
+								}
+
+								// if it's in any relations to be output, do the same for each relation
+								if (inRelation) {
+									for (auto wt = wayRelations[wayId].begin(); wt != wayRelations[wayId].end(); ++wt) {
+										WayID relID = *wt;
+										// relID is now the relation ID
+										for (auto it = tilelist.begin(); it != tilelist.end(); ++it) {
+											// index is now the tile index number
+											TileKey index = *it;
+											// add all the OutputObjects for this relation into this tile
+											for (auto jt = relationOutputObjects[relID].begin(); jt != relationOutputObjects[relID].end(); ++jt) {
+												tileIndex[index].push_back(*jt);
+											}
 										}
 									}
 								}
 							}
 						}
 					}
-				}
 
-				// Everything should be ended
-				break;
+					// Everything should be ended
+					break;
+				}
+				ct++;
 			}
-			ct++;
+			cout << endl;
+			infile.close();
 		}
-		cout << endl;
-		infile.close();
-	}
-
-	// ----	Write out each tile
-
-	// Loop through zoom levels
-	for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
-		// Create list of tiles, and the data in them
-		map< uint, vector<OutputObject> > *tileIndexPtr;
-		map< uint, vector<OutputObject> > generatedIndex;
-		if (zoom==baseZoom) {
-			// ----	Sort each tile
-			for (auto it = tileIndex.begin(); it != tileIndex.end(); ++it) {
-				auto &ooset = it->second;
-				sort(ooset.begin(), ooset.end());
-				ooset.erase(unique(ooset.begin(), ooset.end()), ooset.end());
+		if (!mergeShapefiles(false)) { return -1; }
+
+		// ----	Apply changes to a snapshot
+		//		(expiredTiles holds the tiles to re-render at each zoom level)
+
+		map< uint, set<TileKey> > expiredTiles;
+		if (updating) {
+			updateState.rebuildTileIndex(tileIndex, baseZoom);
+			set<TileKey> dirty;
+			for (auto &changeFile : changeFiles) {
+				try {
+					set<TileKey> touched = updateState.applyChanges(changeFile, osmObject, nodeKeys, tileIndex, baseZoom);
+					dirty.insert(touched.begin(), touched.end());
+				} catch (exception &e) { cerr << changeFile << ": " << e.what() << endl; return -1; }
 			}
-			// at z14, we can just use tileIndex
-			tileIndexPtr = &tileIndex;
-		} else {
-			// otherwise, we need to run through the z14 list, and assign each way
-			// to a tile at our zoom level
-			for (auto it = tileIndex.begin(); it!= tileIndex.end(); ++it) {
-				uint index = it->first;
-				uint tilex = (index >> 16  ) / pow(2, baseZoom-zoom);
-				uint tiley = (index & 65535) / pow(2, baseZoom-zoom);
-				uint newIndex = (tilex << 16) + tiley;
-				const vector<OutputObject> &ooset = it->second;
-				for (auto jt = ooset.begin(); jt != ooset.end(); ++jt) {
-					generatedIndex[newIndex].push_back(*jt);
-				}
+			for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
+				for (auto index : dirty) { expiredTiles[zoom].insert(parentTileKey(index, baseZoom, zoom)); }
 			}
-			// sort each new tile
-			for (auto it = generatedIndex.begin(); it != generatedIndex.end(); ++it) {
-				auto &ooset = it->second;
-				sort(ooset.begin(), ooset.end());
-				ooset.erase(unique(ooset.begin(), ooset.end()), ooset.end());
-			}
-			tileIndexPtr = &generatedIndex;
+			cout << dirty.size() << " tiles changed at z" << baseZoom << endl;
 		}
 
-		// Loop through tiles
-		uint tc = 0;
-		for (auto it = tileIndexPtr->begin(); it != tileIndexPtr->end(); ++it) {
-			if ((tc % 100) == 0) { 
-				cout << "Zoom level " << zoom << ", writing tile " << tc << " of " << tileIndexPtr->size() << "               \r";
-				cout.flush();
-			}
-			tc++;
-
-			// Create tile
-			vector_tile::Tile tile;
-			uint index = it->first;
-			TileBbox bbox(index,zoom);
-			const vector<OutputObject> &ooList = it->second;
-			if (clippingBoxFromJSON && (maxLon<=bbox.minLon || minLon>=bbox.maxLon || maxLat<=bbox.minLat || minLat>=bbox.maxLat)) { continue; }
-
-			// Loop through layers
-			for (auto lt = osmObject.layerOrder.begin(); lt != osmObject.layerOrder.end(); ++lt) {
-				vector<string> keyList;
-				vector<vector_tile::Tile_Value> valueList;
-				vector_tile::Tile_Layer *vtLayer = tile.add_layers();
-
-				for (auto mt = lt->begin(); mt != lt->end(); ++mt) {
-					uint layerNum = *mt;
-					LayerDef ld = osmObject.layers[layerNum];
-					if (zoom<ld.minzoom || zoom>ld.maxzoom) { continue; }
-					double simplifyLevel = 0;
-					if (zoom < ld.simplifyBelow) {
-						if (ld.simplifyLength > 0) {
-							uint tileY = index & 65535;
-							double latp = (tiley2latp(tileY, zoom) + tiley2latp(tileY+1, zoom)) / 2;
-							simplifyLevel = meter2degp(ld.simplifyLength, latp);
-						} else {
-							simplifyLevel = ld.simplifyLevel;
-						}
-						simplifyLevel *= pow(ld.simplifyRatio, (ld.simplifyBelow-1) - zoom);
-					}
+		// ----	Save a snapshot for later updates
 
-					// compare only by `layer`
-					auto layerComp = [](const OutputObject &x, const OutputObject &y) -> bool { return x.layer < y.layer; };
-					// We get the range within ooList, where the layer of each object is `layerNum`.
-					// Note that ooList is sorted by a lexicographic order, `layer` being the most significant.
-					auto ooListSameLayer = equal_range(ooList.begin(), ooList.end(), OutputObject(POINT, layerNum, 0), layerComp);
-					// Loop through output objects
-					for (auto jt = ooListSameLayer.first; jt != ooListSameLayer.second; ++jt) {
-						if (jt->geomType == POINT) {
-							vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
-							jt->buildNodeGeometry(nodes.at(jt->objectID), &bbox, featurePtr);
-							jt->writeAttributes(&keyList, &valueList, featurePtr);
-							if (includeID) { featurePtr->set_id(jt->objectID); }
-						} else {
-							try {
-								Geometry g = jt->buildWayGeometry(osmStore, &bbox, cachedGeometries);
-
-								// If a object is a polygon or a linestring that is followed by
-								// other objects with the same geometry type and the same attributes,
-								// the following objects are merged into the first object, by taking union of geometries.
-								auto gTyp = jt->geomType;
-								if (gTyp == POLYGON || gTyp == CACHED_POLYGON) {
-									MultiPolygon &gAcc = boost::get<MultiPolygon>(g);
-									while (jt+1 != ooListSameLayer.second &&
-											(jt+1)->geomType == gTyp &&
-											(jt+1)->attributes == jt->attributes) {
-										jt++;
-										MultiPolygon gNew = boost::get<MultiPolygon>(jt->buildWayGeometry(osmStore, &bbox, cachedGeometries));
-										MultiPolygon gTmp;
-										geom::union_(gAcc, gNew, gTmp);
-										gAcc = move(gTmp);
-									}
-								}
-								if (gTyp == LINESTRING || gTyp == CACHED_LINESTRING) {
-									MultiLinestring &gAcc = boost::get<MultiLinestring>(g);
-									while (jt+1 != ooListSameLayer.second &&
-											(jt+1)->geomType == gTyp &&
-											(jt+1)->attributes == jt->attributes) {
-										jt++;
-										MultiLinestring gNew = boost::get<MultiLinestring>(jt->buildWayGeometry(osmStore, &bbox, cachedGeometries));
-										MultiLinestring gTmp;
-										geom::union_(gAcc, gNew, gTmp);
-										gAcc = move(gTmp);
-									}
-								}
+		if (!saveSnapshot.empty()) {
+			cout << "Saving snapshot " << saveSnapshot << endl;
+			updateState.newWayID = osmObject.newWayID;
+			updateState.hasClippingBox = hasClippingBox;
+			updateState.clippingBox = clippingBox;
+			try {
+				updateState.save(saveSnapshot);
+			} catch (exception &e) { cerr << e.what() << endl; return -1; }
+		}
 
-								vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
-								WriteGeometryVisitor w(&bbox, featurePtr, simplifyLevel);
-								boost::apply_visitor(w, g);
-								if (featurePtr->geometry_size()==0) { vtLayer->mutable_features()->RemoveLast(); continue; }
-								jt->writeAttributes(&keyList, &valueList, featurePtr);
-								if (includeID) { featurePtr->set_id(jt->objectID); }
-							} catch (...) {
-								if (verbose)  {
-									cerr << "Exception when writing output object " << jt->objectID << " of type " << jt->geomType << endl;
-									if (relations.count(jt->objectID)) {
-										const auto &wayList = relations.at(jt->objectID);
-										for (auto et = wayList.outerBegin; et != wayList.outerEnd; ++et) {
-											if (ways.count(*et)==0) { cerr << " - couldn't find constituent way " << *et << endl; }
-										}
-										for (auto et = wayList.innerBegin; et != wayList.innerEnd; ++et) {
-											if (ways.count(*et)==0) { cerr << " - couldn't find constituent way " << *et << endl; }
-										}
-									}
-								}
-							}
-						}
-					}
-				}
+		// ----	Save the tile index for writing later, or read a saved one
+		//		(just the tiles in this shard)
 
-				// If there are any objects, then add tags
-				if (vtLayer->features_size()>0) {
-					vtLayer->set_name(osmObject.layers[lt->at(0)].name);
-					vtLayer->set_version(1);
-					for (uint j=0; j<keyList.size()  ; j++) {
-						vtLayer->add_keys(keyList[j]);
-					}
-					for (uint j=0; j<valueList.size(); j++) { 
-						vector_tile::Tile_Value *v = vtLayer->add_values();
-						*v = valueList[j];
-					}
-				} else {
-					tile.mutable_layers()->RemoveLast();
-				}
+		if (!saveIndex.empty()) {
+			cout << "Saving index " << saveIndex << endl;
+			try {
+				TileIndexFile::save(saveIndex, baseZoom, clippingBox, hasClippingBox, osmStore, cachedGeometries, cachedGeometryNames, tileIndex);
+			} catch (exception &e) { cerr << e.what() << endl; return -1; }
+			if (outputFile.empty() && servePort==0) { return 0; }
+		}
+		if (loadingIndex) {
+			indexFile.readTiles(tileIndex, [&](TileKey key) { return !shard.active() || shard.includesBaseTile(key); });
+		}
+
+		// ----	Discard anything left outside this shard (e.g. from shapefiles)
+
+		if (shardPrune) {
+			for (auto it = tileIndex.begin(); it != tileIndex.end(); ) {
+				if (shard.includesBaseTile(it->first)) { ++it; } else { it = tileIndex.erase(it); }
 			}
+		}
+
+		// ----	Serve tiles on demand, if that's what we're doing
 
-			// Write to file or sqlite
+		TileBuilder tileBuilder(osmStore, cachedGeometries, osmObject.layers, osmObject.layerOrder, endZoom, includeID, verbose);
+		tileBuilder.maxTileBytes = maxTileBytes;
+		tileBuilder.maxTileFeatures = maxTileFeatures;
+		if (servePort>0) {
+			TileServer server(tileBuilder, tileIndex, baseZoom, startZoom, endZoom, compress, gzip, compressLevels, compressStrategies, serveCache);
+			try {
+				server.run(servePort);
+			} catch (exception &e) { cerr << "Couldn't serve tiles: " << e.what() << endl; return -1; }
+		}
 
-			string data, compressed;
+		// ----	Write out each tile
+
+		uint64_t tilesWritten = 0, bytesUncompressed = 0, bytesWritten = 0, tilesUnchanged = 0, tilesDeleted = 0;
+		map< uint, set<TileKey> > changedTiles;		// tiles written or deleted, for --expire-list
+		unique_ptr<DirectoryWriter> directoryWriter;
+		if (!sqlite && !pmtiles) { directoryWriter.reset(new DirectoryWriter(outputFile, writeThreads, deduplicate)); }
+
+		// Compressed tiles are written from here (one at a time, but not necessarily in order)
+		CompressionPool compressionPool(compressThreads, compress, gzip, compressLevels, compressStrategies, [&](CompressionPool::Tile &tile) {
+			if (tile.remove) {
+				// nothing left in it (only in update mode, so there's one .mbtiles file)
+				mbtiles[0]->deleteTile(tile.zoom, tile.x, tile.y);
+				tilesDeleted++;
+				if (!expireList.empty()) { changedTiles[tile.zoom].insert(tile.index); }
+				return;
+			}
+			if (changedOnly && mbtiles[0]->unchanged(tile.zoom, tile.x, tile.y, tile.data)) { tilesUnchanged++; return; }
+			if (!expireList.empty()) { changedTiles[tile.zoom].insert(tile.index); }
+			tilesWritten++;
+			bytesUncompressed += tile.uncompressedSize;
+			bytesWritten += tile.data.size();
 			if (sqlite) {
 				// Write to sqlite
-				tile.SerializeToString(&data);
-				if (compress) { compressed = compress_string(data, Z_DEFAULT_COMPRESSION, gzip); }
-				mbtiles.saveTile(zoom, bbox.tilex, bbox.tiley, compress ? &compressed : &data);
+				mbtiles[(tile.x + tile.y) % mbtiles.size()]->saveTile(tile.zoom, tile.x, tile.y, &tile.data);
+
+			} else if (pmtiles) {
+				// Write to .pmtiles
+				archive.saveTile(tile.zoom, tile.x, tile.y, &tile.data);
 
 			} else {
 				// Write to file
-				stringstream dirname, filename;
-				dirname  << outputFile << "/" << zoom << "/" << bbox.tilex;
-				filename << outputFile << "/" << zoom << "/" << bbox.tilex << "/" << bbox.tiley << ".pbf";
-				boost::filesystem::create_directories(dirname.str());
-				fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
-				if (compress) {
-					tile.SerializeToString(&data);
-					outfile << compress_string(data, Z_DEFAULT_COMPRESSION, gzip);
-				} else {
-					if (!tile.SerializeToOstream(&outfile)) { cerr << "Couldn't write to " << filename.str() << endl; return -1; }
+				directoryWriter->saveTile(tile.zoom, tile.x, tile.y, &tile.data);
+			}
+		});
+
+		// Loop through zoom levels
+		for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
+			// Create list of tiles, and the data in them
+			map< TileKey, vector<OutputObject> > *tileIndexPtr;
+			map< TileKey, vector<OutputObject> > generatedIndex;
+			if (updating) {
+				// only the expired tiles
+				for (auto index : expiredTiles[zoom]) {
+					generatedIndex[index] = tileBuilder.gather(tileIndex, index, zoom, baseZoom);
+				}
+				tileIndexPtr = &generatedIndex;
+			} else if (zoom==baseZoom) {
+				// ----	Sort each tile
+				for (auto it = tileIndex.begin(); it != tileIndex.end(); ++it) {
+					auto &ooset = it->second;
+					sort(ooset.begin(), ooset.end());
+					ooset.erase(unique(ooset.begin(), ooset.end()), ooset.end());
+				}
+				// at z14, we can just use tileIndex
+				tileIndexPtr = &tileIndex;
+			} else {
+				// otherwise, we need to run through the z14 list, and assign each way
+				// to a tile at our zoom level
+				for (auto it = tileIndex.begin(); it!= tileIndex.end(); ++it) {
+					TileKey newIndex = parentTileKey(it->first, baseZoom, zoom);
+					const vector<OutputObject> &ooset = it->second;
+					for (auto jt = ooset.begin(); jt != ooset.end(); ++jt) {
+						generatedIndex[newIndex].push_back(*jt);
+					}
+				}
+				// sort each new tile, and thin out crowded point layers
+				for (auto it = generatedIndex.begin(); it != generatedIndex.end(); ++it) {
+					auto &ooset = it->second;
+					sort(ooset.begin(), ooset.end());
+					ooset.erase(unique(ooset.begin(), ooset.end()), ooset.end());
+					if (zoom < endZoom) {
+						TileBbox bbox(it->first, zoom);
+						tileBuilder.thinPoints(ooset, zoom, bbox);
+					}
 				}
-				outfile.close();
+				tileIndexPtr = &generatedIndex;
 			}
-		}
-	}
 
-	cout << endl << "Filled the tileset with good things at " << outputFile << endl;
-	google::protobuf::ShutdownProtobufLibrary();
+			// Put the tiles in write order (the index is already in Morton order)
+			typedef pair< uint64_t, map< TileKey, vector<OutputObject> >::const_iterator > OrderedTile;
+			vector<OrderedTile> writeOrder;
+			writeOrder.reserve(tileIndexPtr->size());
+			for (auto it = tileIndexPtr->cbegin(); it != tileIndexPtr->cend(); ++it) {
+				writeOrder.emplace_back(tileOrderKey(tileOrder, it->first, zoom), it);
+			}
+			if (tileOrder != ORDER_MORTON) {
+				sort(writeOrder.begin(), writeOrder.end(), [](const OrderedTile &a, const OrderedTile &b) { return a.first < b.first; });
+			}
 
-	// ---- Call exit_function of Lua logic
-	lua_getglobal(luaState, "exit_function");
-	int exists_exit_function = !lua_isnil(luaState, -1);
-	lua_pop(luaState, 1);
-	if (exists_exit_function) {
-		try { luabind::call_function<int>(luaState, "exit_function");
-		} catch (const luabind::error &er) {
-			cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
-			return -1;
+			// Loop through tiles
+			uint tc = 0;
+			for (auto &ordered : writeOrder) {
+				auto it = ordered.second;
+				if ((tc % 100) == 0) { 
+					cout << "Zoom level " << zoom << ", writing tile " << tc << " of " << tileIndexPtr->size() << "               \r";
+					cout.flush();
+				}
+				tc++;
+
+				// Create tile
+				TileKey index = it->first;
+				TileBbox bbox(index,zoom);
+				const vector<OutputObject> &ooList = it->second;
+				if (shard.active() && !shard.includesTile(index, zoom)) { continue; }
+				if (clippingBoxFromJSON && (maxLon<=bbox.minLon || minLon>=bbox.maxLon || maxLat<=bbox.minLat || minLat>=bbox.maxLat)) { continue; }
+				// (in update mode, a tile with nothing left in it is deleted)
+				bool remove = updating && ooList.empty();
+				string data = remove ? "" : tileBuilder.generate(zoom, bbox, ooList);
+
+				// Compress, then write to file or sqlite
+				try {
+					compressionPool.add(zoom, bbox.tilex, bbox.tiley, index, move(data), remove);
+				} catch (exception &e) { cerr << e.what() << endl; return -1; }
+			}
+		}
+		try {
+			compressionPool.finish();
+		} catch (exception &e) { cerr << e.what() << endl; return -1; }
+
+		// Delete tiles that are no longer generated (within the zoom levels and shard we're writing)
+		if (changedOnly && !updating) {
+			tilesDeleted = mbtiles[0]->deleteRemaining([&](uint zoom, uint x, uint y) {
+				if (zoom<startZoom || zoom>endZoom) { return false; }
+				if (shard.active() && !shard.includesTile(tileKey(x,y), zoom)) { return false; }
+				if (!expireList.empty()) { changedTiles[zoom].insert(tileKey(x,y)); }
+				return true;
+			});
 		}
-	}
 
-    lua_close(luaState);
+		if (directoryWriter) {
+			try {
+				directoryWriter->close();
+			} catch (exception &e) { cerr << e.what() << endl; return -1; }
+		}
+		if (pmtiles) {
+			cout << endl << "Writing .pmtiles" << endl;
+			archive.close();
+		}
+		if (sqlite) {
+			try {
+				for (auto &mb : mbtiles) { mb->close(); }
+				mbtiles.clear();
+				if (outputShards>1) {
+					cout << endl << "Merging " << outputShards << " shards" << endl;
+					MBTiles merged;
+					merged.open(&outputFile, deduplicate, true);	// (bulk-loads if it's a new file)
+					merged.vacuum = vacuum;
+					for (uint i=0; i<outputShards; i++) {
+						string filename = MBTiles::shardFilename(outputFile, i);
+						merged.merge(filename);
+						boost::filesystem::remove(filename);
+					}
+					merged.close();
+				}
+			} catch (exception &e) { cerr << "Couldn't write " << outputFile << ": " << e.what() << endl; return -1; }
+		}
+		if (!expireList.empty()) {
+			ofstream expired(expireList, ios::out | ios::trunc);
+			for (auto &it : changedTiles) {
+				for (auto index : it.second) { expired << it.first << "/" << tileKeyX(index) << "/" << tileKeyY(index) << endl; }
+			}
+		}
+		cout << endl << "Wrote " << tilesWritten << " tiles, " << bytesWritten << " bytes";
+		if (compress) { cout << " (" << bytesUncompressed << " uncompressed)"; }
+		if (tilesUnchanged>0 || tilesDeleted>0) { cout << "; " << tilesUnchanged << " unchanged, " << tilesDeleted << " deleted"; }
+		cout << endl << "Filled the tileset with good things at " << outputFile << endl;
+
+		// ---- Call exit_function of Lua logic
+		lua_getglobal(luaState, "exit_function");
+		int exists_exit_function = !lua_isnil(luaState, -1);
+		lua_pop(luaState, 1);
+		if (exists_exit_function) {
+			try { luabind::call_function<int>(luaState, "exit_function");
+			} catch (const luabind::error &er) {
+				cerr << er.what() << endl << "-- " << lua_tostring(er.state(), -1) << endl;
+				return -1;
+			}
+		}
+
+		return 0;
+	};
+
+	auto modified = [&]() {
+		boost::system::error_code ec;
+		return make_pair(boost::filesystem::last_write_time(luaFile, ec), boost::filesystem::last_write_time(jsonFile, ec));
+	};
+	auto lastModified = modified();
+	int status = render();
+	while (watch) {
+		cout << "Watching " << luaFile << " and " << jsonFile << " for changes" << endl;
+		while (modified() == lastModified) { this_thread::sleep_for(chrono::seconds(1)); }
+		this_thread::sleep_for(chrono::milliseconds(200));	// (let the editor finish saving)
+		lastModified = modified();
+		status = render();
+	}
+	google::protobuf::ShutdownProtobufLibrary();
+	return status;
 }
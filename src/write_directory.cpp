@@ -0,0 +1,212 @@
+// Write tiles to a directory tree (z/x/y.pbf)
+//
+// Tiles are handed to a pool of writer threads, so tile generation doesn't wait on the filesystem.
+// When deduplicating, each tile goes to the worker chosen by its content hash, so the first copy of
+// a tile has always been written before any hard links to it are made. Otherwise tiles are shared
+// out by column, so each worker keeps to its own directories.
+// Directories that have been created are remembered, and on POSIX systems each worker keeps a small
+// LRU cache of open z/x directory handles and writes through openat().
+
+class DirectoryWriter { public:
+
+	static const uint QUEUE_SIZE = 1000;		// tiles waiting per worker before saveTile blocks
+	static const uint OPEN_DIRECTORIES = 64;	// directory handles cached per worker
+
+	DirectoryWriter(const string &root, uint threads, bool dedup) :
+		root(root), deduplicate(dedup), workers(max(threads,1u)) {
+		for (uint i=0; i<workers.size(); i++) {
+			workers[i].writer = thread(&DirectoryWriter::writeQueue, this, i);
+		}
+	}
+
+	~DirectoryWriter() {
+		try { close(); } catch (exception &e) { cerr << "Error writing tiles: " << e.what() << endl; }
+	}
+
+	// Queue a tile to be written
+	void saveTile(uint zoom, uint x, uint y, string *data) {
+		string hash = deduplicate ? content_hash(*data) : "";
+		uint64_t route = deduplicate ? murmur_hash64(hash, 0) : x;
+		Worker &w = workers[route % workers.size()];
+		unique_lock<mutex> lock(w.queueMutex);
+		w.queueNotFull.wait(lock, [&]{ return w.queue.size() < QUEUE_SIZE || failed; });
+		if (failed) { lock.unlock(); rethrowError(); }
+		w.queue.push_back(PendingTile { zoom, x, y, move(hash), *data });
+		w.queueNotEmpty.notify_one();
+	}
+
+	// Wait for all queued tiles to be written
+	void close() {
+		if (closed) { return; }
+		closed = true;
+		for (auto &w : workers) {
+			lock_guard<mutex> lock(w.queueMutex);
+			w.closing = true;
+			w.queueNotEmpty.notify_one();
+		}
+		for (auto &w : workers) {
+			if (w.writer.joinable()) { w.writer.join(); }
+		}
+		if (failed) { rethrowError(); }
+	}
+
+private:
+	struct PendingTile {
+		uint zoom, x, y;
+		string hash;
+		string data;
+	};
+
+#ifndef _WIN32
+	// An open directory, closed when the last user lets go of it
+	struct DirectoryHandle {
+		int fd;
+		DirectoryHandle(int fd) : fd(fd) { }
+		~DirectoryHandle() { ::close(fd); }
+	};
+	typedef list<pair<uint64_t, shared_ptr<DirectoryHandle>>> HandleList;
+#endif
+
+	struct Worker {
+		thread writer;
+		mutex queueMutex;
+		condition_variable queueNotEmpty, queueNotFull;
+		deque<PendingTile> queue;
+		bool closing = false;
+		unordered_map<string, string> writtenFiles;		// content hash -> first file written with it
+#ifndef _WIN32
+		HandleList handles;								// most recently used first
+		unordered_map<uint64_t, HandleList::iterator> handleIndex;
+#endif
+	};
+
+	string root;
+	bool deduplicate;
+	vector<Worker> workers;
+	bool closed = false;
+
+	mutex directoryMutex;
+	unordered_set<uint64_t> createdDirectories;		// z/x directories known to exist
+	atomic<bool> failed { false };
+	mutex errorMutex;
+	exception_ptr writerError;
+
+	void rethrowError() {
+		lock_guard<mutex> lock(errorMutex);
+		rethrow_exception(writerError);
+	}
+
+	static uint64_t directoryKey(uint zoom, uint x) { return (uint64_t(zoom) << 32) | x; }
+
+	string directoryName(uint zoom, uint x) const {
+		return root + "/" + to_string(zoom) + "/" + to_string(x);
+	}
+
+	// Create the z/x directory unless we've already done so
+	void ensureDirectory(uint zoom, uint x) {
+		uint64_t key = directoryKey(zoom, x);
+		{
+			lock_guard<mutex> lock(directoryMutex);
+			if (createdDirectories.count(key)) { return; }
+		}
+		boost::filesystem::create_directories(directoryName(zoom, x));
+		lock_guard<mutex> lock(directoryMutex);
+		createdDirectories.insert(key);
+	}
+
+	// Worker thread: take tiles off its queue and write them
+	void writeQueue(uint index) {
+		Worker &w = workers[index];
+		try {
+			while (true) {
+				PendingTile tile;
+				{
+					unique_lock<mutex> lock(w.queueMutex);
+					w.queueNotEmpty.wait(lock, [&]{ return !w.queue.empty() || w.closing; });
+					if (w.queue.empty()) { break; }
+					tile = move(w.queue.front());
+					w.queue.pop_front();
+					w.queueNotFull.notify_one();
+				}
+				writeTile(w, tile);
+			}
+		} catch (...) {
+			{
+				lock_guard<mutex> lock(errorMutex);
+				if (!writerError) { writerError = current_exception(); }
+			}
+			failed = true;
+			// wake anyone waiting on any worker, so the error is seen
+			for (auto &other : workers) {
+				lock_guard<mutex> lock(other.queueMutex);
+				other.queueNotFull.notify_all();
+			}
+		}
+	}
+
+	void writeTile(Worker &w, const PendingTile &tile) {
+		ensureDirectory(tile.zoom, tile.x);
+		string leaf = to_string(tile.y) + ".pbf";
+		string filename = directoryName(tile.zoom, tile.x) + "/" + leaf;
+		if (deduplicate) {
+			// Hard-link to an identical tile if we've written one already
+			// (identical tiles always come to the same worker, so the original is complete)
+			string &original = w.writtenFiles[tile.hash];
+			if (!original.empty()) {
+				boost::system::error_code ec;
+				boost::filesystem::remove(filename, ec);
+				boost::filesystem::create_hard_link(original, filename, ec);
+				if (!ec) { return; }
+			}
+			// (if linking fails, e.g. because the file has too many links, start again from this copy)
+			original = filename;
+		}
+#ifndef _WIN32
+		shared_ptr<DirectoryHandle> dir = openDirectory(w, tile.zoom, tile.x);
+		// (a file already there may be hard-linked to other tiles by an earlier run,
+		//  so unlink it and write a new one rather than overwriting it)
+		if (unlinkat(dir->fd, leaf.c_str(), 0) != 0 && errno != ENOENT) { throw runtime_error("Couldn't replace " + filename); }
+		int fd = openat(dir->fd, leaf.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) { throw runtime_error("Couldn't write to " + filename); }
+		const char *p = tile.data.data();
+		size_t remaining = tile.data.size();
+		while (remaining > 0) {
+			ssize_t written = ::write(fd, p, remaining);
+			if (written < 0 && errno == EINTR) { continue; }
+			if (written <= 0) { ::close(fd); throw runtime_error("Couldn't write to " + filename); }
+			p += written; remaining -= written;
+		}
+		if (::close(fd) != 0) { throw runtime_error("Couldn't write to " + filename); }
+#else
+		// (as above, don't overwrite a file that may be linked to other tiles)
+		boost::system::error_code ec;
+		boost::filesystem::remove(filename, ec);
+		fstream outfile(filename, ios::out | ios::trunc | ios::binary);
+		outfile << tile.data;
+		outfile.close();
+		if (!outfile) { throw runtime_error("Couldn't write to " + filename); }
+#endif
+	}
+
+#ifndef _WIN32
+	// Get a handle on the z/x directory from the worker's cache, opening it if need be
+	shared_ptr<DirectoryHandle> openDirectory(Worker &w, uint zoom, uint x) {
+		uint64_t key = directoryKey(zoom, x);
+		auto found = w.handleIndex.find(key);
+		if (found != w.handleIndex.end()) {
+			w.handles.splice(w.handles.begin(), w.handles, found->second);
+			return found->second->second;
+		}
+		int fd = ::open(directoryName(zoom, x).c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0) { throw runtime_error("Couldn't open directory " + directoryName(zoom, x)); }
+		shared_ptr<DirectoryHandle> handle = make_shared<DirectoryHandle>(fd);
+		w.handles.emplace_front(key, handle);
+		w.handleIndex[key] = w.handles.begin();
+		if (w.handles.size() > OPEN_DIRECTORIES) {
+			w.handleIndex.erase(w.handles.back().first);
+			w.handles.pop_back();
+		}
+		return handle;
+	}
+#endif
+};
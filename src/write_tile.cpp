@@ -0,0 +1,354 @@
+/*
+	TileBuilder - assembles the vector tile for one z/x/y from its OutputObjects
+
+	If the tile exceeds the configured byte or feature budget, it's regenerated with
+	progressively coarser settings (see Generalization) until it fits.
+*/
+
+// How aggressively a tile is generalised
+struct Generalization {
+	double simplifyFactor = 1.0;	// multiplier for each layer's simplify level
+	vector<bool> dropped;			// objects (by position in the tile's list) to leave out; empty = keep all
+	bool dropAttributes = false;	// write geometries only
+};
+
+class TileBuilder { public:
+
+	const OSMStore &osmStore;
+	const vector<Geometry> &cachedGeometries;
+	const vector<LayerDef> &layers;
+	const vector<vector<uint>> &layerOrder;
+	uint endZoom;
+	bool includeID, verbose;
+	uint maxTileBytes = 0;			// 0 = no limit
+	uint maxTileFeatures = 0;		// 0 = no limit
+
+	TileBuilder(const OSMStore &store, const vector<Geometry> &geoms, const vector<LayerDef> &ls, const vector<vector<uint>> &lo,
+	            uint ez, bool id, bool vb) :
+		osmStore(store), cachedGeometries(geoms), layers(ls), layerOrder(lo), endZoom(ez), includeID(id), verbose(vb) { }
+
+	// Create the tile and return it serialised, shedding detail if it's over budget
+	string generate(uint zoom, TileBbox &bbox, const vector<OutputObject> &ooList) {
+		Generalization gen;
+		string data = encode(zoom, bbox, ooList, gen);
+		if (withinBudget(data)) { return data; }
+
+		uint origBytes = data.size(), origFeatures = featureCount;
+		uint droppedObjects = 0;
+
+		// 1. If it's too many bytes, simplify harder, starting from a quarter-pixel for layers which
+		//    aren't otherwise simplified (this doesn't reduce the feature count, so isn't tried for that)
+		while (maxTileBytes>0 && data.size()>maxTileBytes && gen.simplifyFactor < 8) {
+			gen.simplifyFactor *= 2;
+			data = encode(zoom, bbox, ooList, gen);
+		}
+
+		// 2. Drop the lowest-priority objects until we're within the feature limit
+		//    (only objects that are drawn at this zoom are ranked, so hidden ones don't take up the budget)
+		vector<uint> ranked = rankObjects(zoom, ooList);
+		uint keep = ranked.size();
+		if (maxTileFeatures>0 && featureCount>maxTileFeatures) {
+			keep = min(keep, maxTileFeatures);
+			droppedObjects = dropObjects(gen, ooList.size(), ranked, keep);
+			data = encode(zoom, bbox, ooList, gen);
+		}
+
+		// 3. If still too big, drop attributes, then more objects
+		if (!withinBudget(data)) {
+			gen.dropAttributes = true;
+			data = encode(zoom, bbox, ooList, gen);
+		}
+		// (always keeping the most important object)
+		while (!withinBudget(data) && keep>1) {
+			keep = max(keep * 3 / 4, 1u);
+			droppedObjects = dropObjects(gen, ooList.size(), ranked, keep);
+			data = encode(zoom, bbox, ooList, gen);
+		}
+
+		cerr << "Tile " << zoom << "/" << bbox.tilex << "/" << bbox.tiley << " over budget ("
+		     << origBytes << " bytes, " << origFeatures << " features): ";
+		if (gen.simplifyFactor>1) { cerr << "simplified x" << gen.simplifyFactor << ", "; }
+		if (gen.dropAttributes) { cerr << "dropped attributes, "; }
+		if (droppedObjects>0) { cerr << "dropped " << droppedObjects << " of " << ranked.size() << " objects, "; }
+		cerr << "now " << data.size() << " bytes, " << featureCount << " features" << endl;
+		return data;
+	}
+
+	// Build the tile with the given generalization
+	void buildTile(vector_tile::Tile &tile, uint zoom, TileBbox &bbox, const vector<OutputObject> &ooList, const Generalization &gen) {
+		featureCount = 0;
+
+		// Loop through layers
+		for (auto lt = layerOrder.begin(); lt != layerOrder.end(); ++lt) {
+			vector<string> keyList;
+			vector<vector_tile::Tile_Value> valueList;
+			vector_tile::Tile_Layer *vtLayer = tile.add_layers();
+
+			for (auto mt = lt->begin(); mt != lt->end(); ++mt) {
+				uint layerNum = *mt;
+				const LayerDef &ld = layers[layerNum];
+				if (zoom<ld.minzoom || zoom>ld.maxzoom) { continue; }
+				double simplifyLevel = 0;
+				if (zoom < ld.simplifyBelow) {
+					if (ld.simplifyLength > 0) {
+						double latp = (tiley2latp(bbox.tiley, zoom) + tiley2latp(bbox.tiley+1, zoom)) / 2;
+						simplifyLevel = meter2degp(ld.simplifyLength, latp);
+					} else {
+						simplifyLevel = ld.simplifyLevel;
+					}
+					simplifyLevel *= pow(ld.simplifyRatio, (ld.simplifyBelow-1) - zoom);
+				}
+				if (gen.simplifyFactor > 1) {
+					simplifyLevel = max(simplifyLevel, pixelSize(zoom) / 4) * gen.simplifyFactor;
+				}
+
+				// compare only by `layer`
+				auto layerComp = [](const OutputObject &x, const OutputObject &y) -> bool { return x.layer < y.layer; };
+				// We get the range within ooList, where the layer of each object is `layerNum`.
+				// Note that ooList is sorted by a lexicographic order, `layer` being the most significant.
+				auto ooListSameLayer = equal_range(ooList.begin(), ooList.end(), OutputObject(POINT, layerNum, 0), layerComp);
+				// Objects too small to be seen are dropped below the maximum zoom
+				// (at maxzoom we keep everything, so that overzoomed tiles are complete)
+				auto isSkipped = [&](vector<OutputObject>::const_iterator jt) -> bool {
+					if (!gen.dropped.empty() && gen.dropped[jt - ooList.begin()]) { return true; }
+					return !isDrawn(zoom, *jt);
+				};
+				// Loop through output objects
+				for (auto jt = ooListSameLayer.first; jt != ooListSameLayer.second; ++jt) {
+					if (isSkipped(jt)) { continue; }
+					if (jt->geomType == POINT) {
+						vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
+						jt->buildNodeGeometry(osmStore.nodes.at(jt->objectID), &bbox, featurePtr);
+						if (!gen.dropAttributes) { jt->writeAttributes(&keyList, &valueList, featurePtr); }
+						if (includeID) { featurePtr->set_id(jt->objectID); }
+					} else {
+						try {
+							Geometry g = jt->buildWayGeometry(osmStore, &bbox, cachedGeometries);
+
+							// If a object is a polygon or a linestring that is followed by
+							// other objects with the same geometry type and the same attributes,
+							// the following objects are merged into the first object, by taking union of geometries.
+							auto gTyp = jt->geomType;
+							if (gTyp == POLYGON || gTyp == CACHED_POLYGON) {
+								MultiPolygon &gAcc = boost::get<MultiPolygon>(g);
+								while (jt+1 != ooListSameLayer.second &&
+										(jt+1)->geomType == gTyp &&
+										(jt+1)->attributes == jt->attributes) {
+									jt++;
+									if (isSkipped(jt)) { continue; }
+									MultiPolygon gNew = boost::get<MultiPolygon>(jt->buildWayGeometry(osmStore, &bbox, cachedGeometries));
+									MultiPolygon gTmp;
+									geom::union_(gAcc, gNew, gTmp);
+									gAcc = move(gTmp);
+								}
+							}
+							if (gTyp == LINESTRING || gTyp == CACHED_LINESTRING) {
+								MultiLinestring &gAcc = boost::get<MultiLinestring>(g);
+								while (jt+1 != ooListSameLayer.second &&
+										(jt+1)->geomType == gTyp &&
+										(jt+1)->attributes == jt->attributes) {
+									jt++;
+									if (isSkipped(jt)) { continue; }
+									MultiLinestring gNew = boost::get<MultiLinestring>(jt->buildWayGeometry(osmStore, &bbox, cachedGeometries));
+									MultiLinestring gTmp;
+									geom::union_(gAcc, gNew, gTmp);
+									gAcc = move(gTmp);
+								}
+							}
+
+							vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
+							WriteGeometryVisitor w(&bbox, featurePtr, simplifyLevel);
+							boost::apply_visitor(w, g);
+							if (featurePtr->geometry_size()==0) { vtLayer->mutable_features()->RemoveLast(); continue; }
+							if (!gen.dropAttributes) { jt->writeAttributes(&keyList, &valueList, featurePtr); }
+							if (includeID) { featurePtr->set_id(jt->objectID); }
+						} catch (...) {
+							if (verbose)  {
+								cerr << "Exception when writing output object " << jt->objectID << " of type " << jt->geomType << endl;
+								if (osmStore.relations.count(jt->objectID)) {
+									const auto &wayList = osmStore.relations.at(jt->objectID);
+									for (auto et = wayList.outerBegin; et != wayList.outerEnd; ++et) {
+										if (osmStore.ways.count(*et)==0) { cerr << " - couldn't find constituent way " << *et << endl; }
+									}
+									for (auto et = wayList.innerBegin; et != wayList.innerEnd; ++et) {
+										if (osmStore.ways.count(*et)==0) { cerr << " - couldn't find constituent way " << *et << endl; }
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+
+			// If there are any objects, then add tags
+			if (vtLayer->features_size()>0) {
+				featureCount += vtLayer->features_size();
+				vtLayer->set_name(layers[lt->at(0)].name);
+				vtLayer->set_version(1);
+				for (uint j=0; j<keyList.size()  ; j++) {
+					vtLayer->add_keys(keyList[j]);
+				}
+				for (uint j=0; j<valueList.size(); j++) {
+					vector_tile::Tile_Value *v = vtLayer->add_values();
+					*v = valueList[j];
+				}
+			} else {
+				tile.mutable_layers()->RemoveLast();
+			}
+		}
+	}
+
+	// Collect the objects for a single tile from the base-zoom index, sorted and thinned
+	// (in Morton order, the base-zoom tiles within it are a contiguous range of the index)
+	vector<OutputObject> gather(const map< TileKey, vector<OutputObject> > &tileIndex, TileKey index, uint zoom, uint baseZoom) const {
+		vector<OutputObject> ooList;
+		uint shift = 2 * (baseZoom - zoom);
+		auto end = tileIndex.lower_bound((index+1) << shift);
+		for (auto it = tileIndex.lower_bound(index << shift); it != end; ++it) {
+			ooList.insert(ooList.end(), it->second.begin(), it->second.end());
+		}
+		sort(ooList.begin(), ooList.end());
+		ooList.erase(unique(ooList.begin(), ooList.end()), ooList.end());
+		if (zoom < endZoom) {
+			TileBbox bbox(index, zoom);
+			thinPoints(ooList, zoom, bbox);
+		}
+		return ooList;
+	}
+
+	// Keep only one point per grid cell in layers with thin_points set, optionally counting the rest
+	// (called on each tile's sorted list as it's aggregated from the base zoom, so thinned points
+	//  never reach geometry building)
+	void thinPoints(vector<OutputObject> &ooList, uint zoom, TileBbox &bbox) const {
+		vector<bool> dropped(ooList.size(), false);
+		bool changed = false, needsSort = false;
+		for (uint layerNum=0; layerNum<layers.size(); layerNum++) {
+			const LayerDef &ld = layers[layerNum];
+			if (ld.thinPoints==THIN_NONE || zoom<ld.minzoom || zoom>ld.maxzoom) { continue; }
+			int cellSize = max(1, int(ld.thinPointsCell * 4096 / 256));
+
+			auto layerComp = [](const OutputObject &x, const OutputObject &y) -> bool { return x.layer < y.layer; };
+			auto ooListSameLayer = equal_range(ooList.begin(), ooList.end(), OutputObject(POINT, layerNum, 0), layerComp);
+			unordered_map<uint64_t, uint> cellOwners;		// cell -> position of the point we keep
+			unordered_map<uint, uint> counts;				// position of a kept point -> points it stands for
+			for (auto jt = ooListSameLayer.first; jt != ooListSameLayer.second; ++jt) {
+				pair<int,int> xy;
+				if (jt->geomType == POINT) {
+					LatpLon ll = osmStore.nodes.at(jt->objectID);
+					xy = bbox.scaleLatpLon(ll.latp/10000000.0, ll.lon/10000000.0);
+				} else if (jt->geomType == CACHED_POINT) {
+					const Point &p = boost::get<Point>(cachedGeometries[jt->objectID]);
+					xy = bbox.scaleLatpLon(p.y(), p.x());
+				} else {
+					continue;
+				}
+				uint64_t cell = (uint64_t(uint32_t(xy.first / cellSize)) << 32) | uint32_t(xy.second / cellSize);
+				uint pos = jt - ooList.begin();
+				auto owner = cellOwners.find(cell);
+				if (owner == cellOwners.end()) {
+					cellOwners[cell] = pos;
+					counts[pos] = 1;
+					continue;
+				}
+				uint keptPos = owner->second;
+				if (ld.thinPoints==THIN_PRIORITY && ooList[pos].priority > ooList[keptPos].priority) {
+					// this point supersedes the one we'd kept
+					dropped[keptPos] = true;
+					counts[pos] = counts[keptPos] + 1;
+					counts.erase(keptPos);
+					owner->second = pos;
+				} else {
+					dropped[pos] = true;
+					counts[keptPos]++;
+				}
+				changed = true;
+			}
+
+			if (!ld.clusterCount.empty()) {
+				for (auto ct : counts) {
+					vector_tile::Tile_Value v;
+					setIntegerValue(v, ct.second);
+					ooList[ct.first].addAttribute(ld.clusterCount, v);
+				}
+				needsSort = true;
+			}
+		}
+		if (!changed && !needsSort) { return; }
+
+		uint kept = 0;
+		for (uint i=0; i<ooList.size(); i++) {
+			if (!dropped[i]) { ooList[kept++] = move(ooList[i]); }
+		}
+		ooList.resize(kept, OutputObject(POINT, 0, 0));
+		if (needsSort) { sort(ooList.begin(), ooList.end()); }
+	}
+
+private:
+	uint featureCount;				// features in the most recently built tile
+
+	string encode(uint zoom, TileBbox &bbox, const vector<OutputObject> &ooList, const Generalization &gen) {
+		vector_tile::Tile tile;
+		buildTile(tile, zoom, bbox, ooList, gen);
+		string data;
+		tile.SerializeToString(&data);
+		return data;
+	}
+
+	bool withinBudget(const string &data) const {
+		return (maxTileBytes==0 || data.size()<=maxTileBytes) && (maxTileFeatures==0 || featureCount<=maxTileFeatures);
+	}
+
+	// Would buildTile draw this object at this zoom?
+	// (objects too small to be seen are left out below the maximum zoom, so that overzoomed tiles are complete)
+	bool isDrawn(uint zoom, const OutputObject &oo) const {
+		const LayerDef &ld = layers[oo.layer];
+		if (zoom<ld.minzoom || zoom>ld.maxzoom) { return false; }
+		return !(zoom < endZoom && oo.isTiny(zoom, ld.minAreaPixels, ld.minLengthPixels));
+	}
+
+	// Order the objects drawn at this zoom from most to least important: by priority, then by size.
+	// Points have no size, and lines and polygons are measured differently, so each kind is ranked
+	// by size separately (polygons by area, lines by length, points in their original order),
+	// and the kinds take turns at each priority.
+	vector<uint> rankObjects(uint zoom, const vector<OutputObject> &ooList) const {
+		vector<uint> ranked;
+		for (uint i=0; i<ooList.size(); i++) {
+			if (isDrawn(zoom, ooList[i])) { ranked.push_back(i); }
+		}
+		auto kind = [](const OutputObject &oo) -> uint {
+			if (oo.geomType==POINT || oo.geomType==CACHED_POINT) { return 2; }
+			if (oo.geomType==LINESTRING || oo.geomType==CACHED_LINESTRING) { return 1; }
+			return 0;
+		};
+		auto size = [&](const OutputObject &oo) -> double {
+			return kind(oo)==1 ? max(oo.bbox.width(), oo.bbox.height()) : oo.bbox.width()*oo.bbox.height();
+		};
+		stable_sort(ranked.begin(), ranked.end(), [&](uint a, uint b) {
+			const OutputObject &x = ooList[a], &y = ooList[b];
+			if (kind(x) != kind(y)) { return kind(x) < kind(y); }
+			if (x.priority != y.priority) { return x.priority > y.priority; }
+			return size(x) > size(y);
+		});
+		// position of each object within its kind and priority
+		vector<uint> turn(ooList.size(), 0);
+		for (uint i=1; i<ranked.size(); i++) {
+			const OutputObject &x = ooList[ranked[i-1]], &y = ooList[ranked[i]];
+			if (kind(x)==kind(y) && x.priority==y.priority) { turn[ranked[i]] = turn[ranked[i-1]] + 1; }
+		}
+		stable_sort(ranked.begin(), ranked.end(), [&](uint a, uint b) {
+			const OutputObject &x = ooList[a], &y = ooList[b];
+			if (x.priority != y.priority) { return x.priority > y.priority; }
+			if (turn[a] != turn[b]) { return turn[a] < turn[b]; }
+			return kind(x) < kind(y);
+		});
+		return ranked;
+	}
+
+	// Keep only the first `keep` ranked objects; returns the number dropped
+	// (objects that weren't ranked aren't drawn anyway)
+	uint dropObjects(Generalization &gen, uint numObjects, const vector<uint> &ranked, uint keep) const {
+		gen.dropped.assign(numObjects, false);
+		for (uint i=keep; i<ranked.size(); i++) { gen.dropped[ranked[i]] = true; }
+		return ranked.size() - keep;
+	}
+};